@@ -34,6 +34,8 @@ let package = Package(
             resources: [],
             swiftSettings: [
                 // .define("LUASWIFT_NO_FOUNDATION")
+                // Removes checks which only detect API misuse, such as using a LuaValue with an unrelated state
+                // .define("LUASWIFT_UNCHECKED", .when(configuration: .release))
             ]
         ),
         .target(
@@ -4,6 +4,7 @@
 #define LUASWIFT_MINIMAL_CLUA
 #include "CLua.h"
 #include <errno.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -121,14 +122,14 @@ int luaswift_searcher_preload(lua_State *L) {
 #endif
 }
 
-int luaswift_callclosurewrapper(lua_State *L) {
-    // The function pointer for LuaClosureWrapper.callClosure is in the registry keyed by the
-    // luaswift_callclosurewrapper function pointer.
-    lua_pushcfunction(L, luaswift_callclosurewrapper);
-    lua_rawget(L, LUA_REGISTRYINDEX);
-    lua_CFunction LuaClosureWrapper_callClosure = lua_tocfunction(L, -1);
-    lua_pop(L, 1);
+// Set once by LuaClosureWrapper before any closure is pushed.
+static lua_CFunction LuaClosureWrapper_callClosure = NULL;
 
+void luaswift_setcallclosurewrapperimpl(lua_CFunction fn) {
+    LuaClosureWrapper_callClosure = fn;
+}
+
+int luaswift_callclosurewrapper(lua_State *L) {
     int ret = LuaClosureWrapper_callClosure(L);
     if (ret == LUASWIFT_CALLCLOSURE_ERROR) {
         return lua_error(L);
@@ -141,6 +142,24 @@ _Bool luaswift_iscallclosurewrapper(lua_CFunction fn) {
     return fn == luaswift_callclosurewrapper;
 }
 
+static luaswift_ProtectedFn callProtectedImpl = NULL;
+
+void luaswift_setcallprotectedimpl(luaswift_ProtectedFn fn) {
+    callProtectedImpl = fn;
+}
+
+// The last argument must be a light userdata context pointer, which is popped and passed to callProtectedImpl.
+int luaswift_callprotected(lua_State *L) {
+    void *ctx = lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    int ret = callProtectedImpl(L, ctx);
+    if (ret == LUASWIFT_CALLCLOSURE_ERROR) {
+        return lua_error(L);
+    } else {
+        return ret;
+    }
+}
+
 int luaswift_gettable(lua_State *L) {
     lua_gettable(L, 1);
     return 1;
@@ -197,6 +216,582 @@ void luaswift_lua_Debug_gettransfers(const lua_Debug* d, unsigned short *ftransf
 #endif
 }
 
+// Expects the ncolumns column names to be on the top of the stack, in the same order as columns. Records are accessed
+// with lua_rawget so no metamethods are invoked and nothing here can error. Returns 0 on success, or the 1-based row
+// number of the first record which was not a table or which was missing a field or had a field of the wrong type.
+// String slices point into the Lua strings, so are only valid while the table at index is.
+lua_Integer luaswift_tocolumns(lua_State *L, int index, lua_Integer nrows, luaswift_Column *columns, int ncolumns) {
+    index = lua_absindex(L, index);
+    const int keys = lua_gettop(L) - ncolumns + 1;
+    for (lua_Integer row = 1; row <= nrows; row++) {
+        if (lua_rawgeti(L, index, row) != LUA_TTABLE) {
+            lua_pop(L, 1);
+            return row;
+        }
+        for (int c = 0; c < ncolumns; c++) {
+            lua_pushvalue(L, keys + c);
+            const int t = lua_rawget(L, -2);
+            int ok = 0;
+            switch (columns[c].type) {
+            case LUASWIFT_COLUMN_INTEGER:
+                if (t == LUA_TNUMBER) {
+                    ((lua_Integer *)columns[c].values)[row - 1] = lua_tointegerx(L, -1, &ok);
+                }
+                break;
+            case LUASWIFT_COLUMN_NUMBER:
+                if (t == LUA_TNUMBER) {
+                    ((lua_Number *)columns[c].values)[row - 1] = lua_tonumberx(L, -1, &ok);
+                }
+                break;
+            case LUASWIFT_COLUMN_STRING:
+                if (t == LUA_TSTRING) {
+                    luaswift_StringSlice *slice = &((luaswift_StringSlice *)columns[c].values)[row - 1];
+                    slice->ptr = lua_tolstring(L, -1, &slice->len);
+                    ok = 1;
+                }
+                break;
+            }
+            lua_pop(L, 1);
+            if (!ok) {
+                lua_pop(L, 1); // row
+                return row;
+            }
+        }
+        lua_pop(L, 1); // row
+    }
+    return 0;
+}
+
+// Must be called via lua_pcall, with arguments (fn, inputs, n, policy, msgh). Calls fn once for each of inputs[1]
+// to inputs[n], and returns a table containing the first result of each call and a table containing the error from
+// each call that failed (which will be empty unless policy is LUASWIFT_BATCH_COLLECT). With LUASWIFT_BATCH_STOP, fn is
+// called unprotected so the first error propagates out of the whole batch. Otherwise each call is made with lua_pcall
+// using msgh as the message handler, if it is not nil.
+int luaswift_callbatch(lua_State *L) {
+    const lua_Integer n = lua_tointeger(L, 3);
+    const int policy = (int)lua_tointeger(L, 4);
+    const int msgh = lua_isnil(L, 5) ? 0 : 5;
+    lua_settop(L, 5);
+    lua_createtable(L, (int)n, 0); // 6: results
+    lua_newtable(L); // 7: errors
+    luaL_checkstack(L, 2, NULL);
+    for (lua_Integer i = 1; i <= n; i++) {
+        lua_pushvalue(L, 1);
+        lua_rawgeti(L, 2, i);
+        if (policy == LUASWIFT_BATCH_STOP) {
+            lua_call(L, 1, 1);
+        } else if (lua_pcall(L, 1, 1, msgh) != 0) {
+            if (policy == LUASWIFT_BATCH_COLLECT) {
+                lua_rawseti(L, 7, i);
+            } else {
+                lua_pop(L, 1);
+            }
+            continue;
+        }
+        lua_rawseti(L, 6, i);
+    }
+    return 2;
+}
+
+// Same rules as LuaValue.checkTopIsIndexable()
+static int indexable(lua_State *L, int idx) {
+    if (lua_type(L, idx) == LUA_TTABLE) {
+        return 1;
+    }
+    luaL_checkstack(L, 1, NULL);
+    int t = luaL_getmetafield(L, idx, "__index");
+    if (t == LUA_TNIL) {
+        return 0;
+    }
+    int result = t == LUA_TFUNCTION || indexable(L, lua_gettop(L));
+    lua_pop(L, 1);
+    return result;
+}
+
+static int pathfailed(lua_State *L, int status) {
+    lua_pushnil(L);
+    lua_pushinteger(L, status);
+    return 2;
+}
+
+// Arg 1 is the value to index and the remaining args are the keys of a LuaPath. Returns the result and one of the
+// LUASWIFT_PATH_* values.
+int luaswift_getpath(lua_State *L) {
+    const int nargs = lua_gettop(L);
+    lua_pushvalue(L, 1);
+    for (int i = 2; i <= nargs; i++) {
+        const int t = lua_type(L, -1);
+        if (t == LUA_TNIL) {
+            return pathfailed(L, LUASWIFT_PATH_NIL);
+        } else if (t != LUA_TTABLE && !indexable(L, lua_gettop(L))) {
+            return pathfailed(L, LUASWIFT_PATH_NOTINDEXABLE);
+        }
+        lua_pushvalue(L, i);
+        lua_gettable(L, -2);
+        lua_remove(L, -2);
+    }
+    lua_pushinteger(L, LUASWIFT_PATH_OK);
+    return 2;
+}
+
+// The vector library. Vectors and matrices are userdata created in the same way as LuaSwift's pushuserdata() (so Swift
+// can push and convert them like any other userdata) but their metamethods are all implemented here. New values are
+// created by copying the userdata header and metatable from template values created by Swift, and values are
+// identified by comparing their metatable with the template's. Every function in the library is a C closure with the
+// templates, their metatables and the methods table as upvalues, so none of this needs a registry lookup.
+
+#define VECTOR_TEMPLATE lua_upvalueindex(1)
+#define VECTOR_MT lua_upvalueindex(2)
+#define MATRIX_TEMPLATE lua_upvalueindex(3)
+#define MATRIX_MT lua_upvalueindex(4)
+#define VECTOR_METHODS lua_upvalueindex(5)
+#define VECTOR_NUPVALUES 5
+
+static size_t vector_headersize;
+
+static void* testvalue(lua_State *L, int idx, int mtidx) {
+    if (lua_type(L, idx) != LUA_TUSERDATA || !lua_getmetatable(L, idx)) {
+        return NULL;
+    }
+    int match = lua_rawequal(L, -1, mtidx);
+    lua_pop(L, 1);
+    return match ? (char *)lua_touserdata(L, idx) + vector_headersize : NULL;
+}
+
+static void* newvalue(lua_State *L, size_t size, int templateidx, int mtidx) {
+    char *ud = luaswift_newuserdata(L, vector_headersize + size);
+    memcpy(ud, lua_touserdata(L, templateidx), vector_headersize);
+    lua_pushvalue(L, mtidx);
+    lua_setmetatable(L, -2);
+    return ud + vector_headersize;
+}
+
+#define testvector(L, idx) ((luaswift_Vector *)testvalue(L, idx, VECTOR_MT))
+#define testmatrix(L, idx) ((luaswift_Matrix4 *)testvalue(L, idx, MATRIX_MT))
+#define newvector(L) ((luaswift_Vector *)newvalue(L, sizeof(luaswift_Vector), VECTOR_TEMPLATE, VECTOR_MT))
+#define newmatrix(L) ((luaswift_Matrix4 *)newvalue(L, sizeof(luaswift_Matrix4), MATRIX_TEMPLATE, MATRIX_MT))
+
+static luaswift_Vector* checkvector(lua_State *L, int idx) {
+    luaswift_Vector *v = testvector(L, idx);
+    if (v == NULL) {
+        luaL_argerror(L, idx, "vector expected");
+    }
+    return v;
+}
+
+static luaswift_Matrix4* checkmatrix(lua_State *L, int idx) {
+    luaswift_Matrix4 *m = testmatrix(L, idx);
+    if (m == NULL) {
+        luaL_argerror(L, idx, "matrix expected");
+    }
+    return m;
+}
+
+static void checksamesize(lua_State *L, const luaswift_Vector *a, const luaswift_Vector *b) {
+    if (a->n != b->n) {
+        luaL_error(L, "vector sizes differ (%d and %d)", (int)a->n, (int)b->n);
+    }
+}
+
+static int luaswift_vector_new(lua_State *L) {
+    int n = lua_gettop(L);
+    luaL_argcheck(L, n >= 2 && n <= 4, n > 4 ? 5 : n + 1, "vectors must have 2, 3 or 4 components");
+    lua_Number v[4] = { 0, 0, 0, 0 };
+    for (int i = 0; i < n; i++) {
+        v[i] = luaL_checknumber(L, i + 1);
+    }
+    luaswift_Vector *result = newvector(L);
+    result->n = n;
+    memcpy(result->v, v, sizeof(v));
+    return 1;
+}
+
+static int luaswift_vector_add(lua_State *L) {
+    luaswift_Vector *a = checkvector(L, 1);
+    luaswift_Vector *b = checkvector(L, 2);
+    checksamesize(L, a, b);
+    luaswift_Vector *result = newvector(L);
+    result->n = a->n;
+    for (int i = 0; i < 4; i++) {
+        result->v[i] = a->v[i] + b->v[i];
+    }
+    return 1;
+}
+
+static int luaswift_vector_sub(lua_State *L) {
+    luaswift_Vector *a = checkvector(L, 1);
+    luaswift_Vector *b = checkvector(L, 2);
+    checksamesize(L, a, b);
+    luaswift_Vector *result = newvector(L);
+    result->n = a->n;
+    for (int i = 0; i < 4; i++) {
+        result->v[i] = a->v[i] - b->v[i];
+    }
+    return 1;
+}
+
+// vector * vector is element-wise, vector * number and number * vector scale the vector.
+static int luaswift_vector_mul(lua_State *L) {
+    luaswift_Vector *a = testvector(L, 1);
+    luaswift_Vector *b = testvector(L, 2);
+    luaswift_Vector *result;
+    if (a && b) {
+        checksamesize(L, a, b);
+        result = newvector(L);
+        result->n = a->n;
+        for (int i = 0; i < 4; i++) {
+            result->v[i] = a->v[i] * b->v[i];
+        }
+    } else {
+        int vidx = a ? 1 : 2;
+        luaswift_Vector *v = checkvector(L, vidx);
+        lua_Number k = luaL_checknumber(L, 3 - vidx);
+        result = newvector(L);
+        result->n = v->n;
+        for (int i = 0; i < 4; i++) {
+            result->v[i] = v->v[i] * k;
+        }
+    }
+    return 1;
+}
+
+// vector / vector is element-wise, vector / number divides every element by the number.
+static int luaswift_vector_div(lua_State *L) {
+    luaswift_Vector *a = checkvector(L, 1);
+    luaswift_Vector *b = testvector(L, 2);
+    luaswift_Vector *result;
+    if (b) {
+        checksamesize(L, a, b);
+        result = newvector(L);
+        for (int i = 0; i < a->n; i++) {
+            result->v[i] = a->v[i] / b->v[i];
+        }
+    } else {
+        lua_Number k = luaL_checknumber(L, 2);
+        result = newvector(L);
+        for (int i = 0; i < a->n; i++) {
+            result->v[i] = a->v[i] / k;
+        }
+    }
+    result->n = a->n;
+    for (int i = (int)a->n; i < 4; i++) {
+        result->v[i] = 0;
+    }
+    return 1;
+}
+
+static int luaswift_vector_unm(lua_State *L) {
+    luaswift_Vector *a = checkvector(L, 1);
+    luaswift_Vector *result = newvector(L);
+    result->n = a->n;
+    for (int i = 0; i < 4; i++) {
+        result->v[i] = -a->v[i];
+    }
+    return 1;
+}
+
+static int luaswift_vector_len(lua_State *L) {
+    lua_pushinteger(L, checkvector(L, 1)->n);
+    return 1;
+}
+
+static int luaswift_vector_eq(lua_State *L) {
+    luaswift_Vector *a = testvector(L, 1);
+    luaswift_Vector *b = testvector(L, 2);
+    int result = a && b && a->n == b->n;
+    for (int i = 0; result && i < a->n; i++) {
+        result = a->v[i] == b->v[i];
+    }
+    lua_pushboolean(L, result);
+    return 1;
+}
+
+// Supports v[1] to v[n], v.x, v.y, v.z and v.w (as appropriate for n), and looking up vector methods.
+static int luaswift_vector_index(lua_State *L) {
+    luaswift_Vector *v = checkvector(L, 1);
+    lua_Integer i = 0;
+    if (lua_type(L, 2) == LUA_TNUMBER) {
+        int isint = 0;
+        i = lua_tointegerx(L, 2, &isint);
+        if (!isint) {
+            i = 0;
+        }
+    } else if (lua_type(L, 2) == LUA_TSTRING) {
+        size_t len;
+        const char *key = lua_tolstring(L, 2, &len);
+        if (len == 1) {
+            switch (key[0]) {
+                case 'x': i = 1; break;
+                case 'y': i = 2; break;
+                case 'z': i = 3; break;
+                case 'w': i = 4; break;
+                default: break;
+            }
+        }
+    }
+    if (i >= 1 && i <= v->n) {
+        lua_pushnumber(L, v->v[i - 1]);
+    } else if (lua_type(L, 2) == LUA_TSTRING && i == 0) {
+        lua_pushvalue(L, 2);
+        lua_rawget(L, VECTOR_METHODS);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+static int pushnumberlist(lua_State *L, const char *prefix, const lua_Number *values, int n) {
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    luaL_addstring(&b, prefix);
+    luaL_addchar(&b, '(');
+    for (int i = 0; i < n; i++) {
+        if (i > 0) {
+            luaL_addstring(&b, ", ");
+        }
+        lua_pushnumber(L, values[i]);
+        luaL_addvalue(&b);
+    }
+    luaL_addchar(&b, ')');
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static int luaswift_vector_tostring(lua_State *L) {
+    luaswift_Vector *v = checkvector(L, 1);
+    return pushnumberlist(L, "vector", v->v, (int)v->n);
+}
+
+static int luaswift_vector_dot(lua_State *L) {
+    luaswift_Vector *a = checkvector(L, 1);
+    luaswift_Vector *b = checkvector(L, 2);
+    checksamesize(L, a, b);
+    lua_Number result = 0;
+    for (int i = 0; i < a->n; i++) {
+        result += a->v[i] * b->v[i];
+    }
+    lua_pushnumber(L, result);
+    return 1;
+}
+
+static int luaswift_vector_cross(lua_State *L) {
+    luaswift_Vector *a = checkvector(L, 1);
+    luaswift_Vector *b = checkvector(L, 2);
+    luaL_argcheck(L, a->n == 3, 1, "3-component vector expected");
+    luaL_argcheck(L, b->n == 3, 2, "3-component vector expected");
+    luaswift_Vector *result = newvector(L);
+    result->n = 3;
+    result->v[0] = a->v[1] * b->v[2] - a->v[2] * b->v[1];
+    result->v[1] = a->v[2] * b->v[0] - a->v[0] * b->v[2];
+    result->v[2] = a->v[0] * b->v[1] - a->v[1] * b->v[0];
+    result->v[3] = 0;
+    return 1;
+}
+
+static lua_Number vectorlength(const luaswift_Vector *v) {
+    lua_Number sum = 0;
+    for (int i = 0; i < v->n; i++) {
+        sum += v->v[i] * v->v[i];
+    }
+    return sqrt(sum);
+}
+
+static int luaswift_vector_length(lua_State *L) {
+    lua_pushnumber(L, vectorlength(checkvector(L, 1)));
+    return 1;
+}
+
+static int luaswift_vector_normalize(lua_State *L) {
+    luaswift_Vector *a = checkvector(L, 1);
+    lua_Number len = vectorlength(a);
+    luaswift_Vector *result = newvector(L);
+    result->n = a->n;
+    for (int i = 0; i < 4; i++) {
+        result->v[i] = len == 0 ? 0 : a->v[i] / len;
+    }
+    return 1;
+}
+
+// Takes 16 numbers in column-major order.
+static int luaswift_matrix_new(lua_State *L) {
+    lua_Number m[16];
+    for (int i = 0; i < 16; i++) {
+        m[i] = luaL_checknumber(L, i + 1);
+    }
+    memcpy(newmatrix(L)->m, m, sizeof(m));
+    return 1;
+}
+
+static int luaswift_matrix_identity(lua_State *L) {
+    luaswift_Matrix4 *result = newmatrix(L);
+    for (int i = 0; i < 16; i++) {
+        result->m[i] = (i % 5 == 0) ? 1 : 0;
+    }
+    return 1;
+}
+
+// matrix * matrix, matrix * 4-component vector, and matrix * number or number * matrix.
+static int luaswift_matrix_mul(lua_State *L) {
+    luaswift_Matrix4 *a = testmatrix(L, 1);
+    if (a == NULL) {
+        lua_Number k = luaL_checknumber(L, 1);
+        luaswift_Matrix4 *b = checkmatrix(L, 2);
+        luaswift_Matrix4 *result = newmatrix(L);
+        for (int i = 0; i < 16; i++) {
+            result->m[i] = k * b->m[i];
+        }
+        return 1;
+    }
+    luaswift_Matrix4 *b = testmatrix(L, 2);
+    if (b) {
+        luaswift_Matrix4 *result = newmatrix(L);
+        for (int col = 0; col < 4; col++) {
+            for (int row = 0; row < 4; row++) {
+                lua_Number sum = 0;
+                for (int k = 0; k < 4; k++) {
+                    sum += a->m[k * 4 + row] * b->m[col * 4 + k];
+                }
+                result->m[col * 4 + row] = sum;
+            }
+        }
+        return 1;
+    }
+    luaswift_Vector *v = testvector(L, 2);
+    if (v) {
+        luaL_argcheck(L, v->n == 4, 2, "4-component vector expected");
+        luaswift_Vector *result = newvector(L);
+        result->n = 4;
+        for (int row = 0; row < 4; row++) {
+            lua_Number sum = 0;
+            for (int k = 0; k < 4; k++) {
+                sum += a->m[k * 4 + row] * v->v[k];
+            }
+            result->v[row] = sum;
+        }
+        return 1;
+    }
+    lua_Number k = luaL_checknumber(L, 2);
+    luaswift_Matrix4 *result = newmatrix(L);
+    for (int i = 0; i < 16; i++) {
+        result->m[i] = a->m[i] * k;
+    }
+    return 1;
+}
+
+static int luaswift_matrix_eq(lua_State *L) {
+    luaswift_Matrix4 *a = testmatrix(L, 1);
+    luaswift_Matrix4 *b = testmatrix(L, 2);
+    int result = a && b;
+    for (int i = 0; result && i < 16; i++) {
+        result = a->m[i] == b->m[i];
+    }
+    lua_pushboolean(L, result);
+    return 1;
+}
+
+// Supports m[1] to m[16] (in column-major order), and looking up matrix methods.
+static int luaswift_matrix_index(lua_State *L) {
+    luaswift_Matrix4 *m = checkmatrix(L, 1);
+    int isint = 0;
+    lua_Integer i = lua_tointegerx(L, 2, &isint);
+    if (lua_type(L, 2) == LUA_TNUMBER && isint && i >= 1 && i <= 16) {
+        lua_pushnumber(L, m->m[i - 1]);
+    } else if (lua_type(L, 2) == LUA_TSTRING) {
+        lua_pushvalue(L, 2);
+        lua_rawget(L, VECTOR_METHODS);
+    } else {
+        lua_pushnil(L);
+    }
+    return 1;
+}
+
+static int luaswift_matrix_tostring(lua_State *L) {
+    return pushnumberlist(L, "matrix", checkmatrix(L, 1)->m, 16);
+}
+
+static int luaswift_matrix_transpose(lua_State *L) {
+    luaswift_Matrix4 *a = checkmatrix(L, 1);
+    luaswift_Matrix4 *result = newmatrix(L);
+    for (int col = 0; col < 4; col++) {
+        for (int row = 0; row < 4; row++) {
+            result->m[row * 4 + col] = a->m[col * 4 + row];
+        }
+    }
+    return 1;
+}
+
+static const luaL_Reg vector_metamethods[] = {
+    { "__add", luaswift_vector_add },
+    { "__sub", luaswift_vector_sub },
+    { "__mul", luaswift_vector_mul },
+    { "__div", luaswift_vector_div },
+    { "__unm", luaswift_vector_unm },
+    { "__len", luaswift_vector_len },
+    { "__eq", luaswift_vector_eq },
+    { "__index", luaswift_vector_index },
+    { "__tostring", luaswift_vector_tostring },
+    { NULL, NULL }
+};
+
+static const luaL_Reg matrix_metamethods[] = {
+    { "__mul", luaswift_matrix_mul },
+    { "__eq", luaswift_matrix_eq },
+    { "__index", luaswift_matrix_index },
+    { "__tostring", luaswift_matrix_tostring },
+    { NULL, NULL }
+};
+
+// Available both as methods on values, and in the library table
+static const luaL_Reg vector_methods[] = {
+    { "dot", luaswift_vector_dot },
+    { "cross", luaswift_vector_cross },
+    { "length", luaswift_vector_length },
+    { "normalize", luaswift_vector_normalize },
+    { "transpose", luaswift_matrix_transpose },
+    { NULL, NULL }
+};
+
+static const luaL_Reg vector_constructors[] = {
+    { "new", luaswift_vector_new },
+    { "matrix", luaswift_matrix_new },
+    { "identity", luaswift_matrix_identity },
+    { NULL, NULL }
+};
+
+static void setvectorfuncs(lua_State *L, int target, const luaL_Reg *fns, int vector, int matrix, int methods) {
+    lua_pushvalue(L, target);
+    lua_pushvalue(L, vector);
+    lua_getmetatable(L, vector);
+    lua_pushvalue(L, matrix);
+    lua_getmetatable(L, matrix);
+    lua_pushvalue(L, methods);
+    luaL_setfuncs(L, fns, VECTOR_NUPVALUES);
+    lua_pop(L, 1); // target
+}
+
+// Expects the template vector, template matrix, (empty) methods table and (empty) library table on the top of the
+// stack. Adds the metamethods to the templates' metatables, and the functions to the methods and library tables. Pops
+// everything except the library table.
+void luaswift_openvectorlib(lua_State *L, size_t headersize) {
+    vector_headersize = headersize;
+    luaL_checkstack(L, VECTOR_NUPVALUES + 2, NULL);
+    const int lib = lua_gettop(L);
+    const int methods = lib - 1;
+    const int matrix = lib - 2;
+    const int vector = lib - 3;
+    lua_getmetatable(L, vector);
+    setvectorfuncs(L, lua_gettop(L), vector_metamethods, vector, matrix, methods);
+    lua_pop(L, 1);
+    lua_getmetatable(L, matrix);
+    setvectorfuncs(L, lua_gettop(L), matrix_metamethods, vector, matrix, methods);
+    lua_pop(L, 1);
+    setvectorfuncs(L, methods, vector_methods, vector, matrix, methods);
+    setvectorfuncs(L, lib, vector_methods, vector, matrix, methods);
+    setvectorfuncs(L, lib, vector_constructors, vector, matrix, methods);
+    lua_replace(L, vector); // Move lib down
+    lua_settop(L, vector);
+}
+
 int luaswift_setgen(lua_State* L, int minormul, int majormul) {
 #if LUA_VERSION_NUM >= 504
     return lua_gc(L, LUA_GCGEN, minormul, majormul);
@@ -177,6 +177,17 @@ static inline void* lua_getextraspace(lua_State* L) {
 }
 #endif
 
+// Returns the LUA_EXTRASPACE area of L if it is large enough to hold a pointer, otherwise NULL. LuaSwift uses this to
+// store a pointer to its per-state context.
+static inline void** luaswift_getextraspace(lua_State* L) {
+#if LUA_VERSION_NUM >= 503
+    if (LUA_EXTRASPACE >= sizeof(void*)) {
+        return (void**)lua_getextraspace(L);
+    }
+#endif
+    return NULL;
+}
+
 #ifdef lua_newuserdata
 #undef lua_newuserdata
 static inline void* lua_newuserdata(lua_State* L, size_t sz) {
@@ -200,7 +211,11 @@ int luaswift_loadfile(lua_State *L, const char *filename,
 
 #define LUASWIFT_CALLCLOSURE_ERROR (-2)
 int luaswift_callclosurewrapper(lua_State *L);
+void luaswift_setcallclosurewrapperimpl(lua_CFunction fn);
 _Bool luaswift_iscallclosurewrapper(lua_CFunction fn);
+typedef int (*luaswift_ProtectedFn)(lua_State *L, void *ctx);
+int luaswift_callprotected(lua_State *L);
+void luaswift_setcallprotectedimpl(luaswift_ProtectedFn fn);
 int luaswift_gettable(lua_State *L);
 int luaswift_settable(lua_State *L);
 int luaswift_tostring(lua_State *L);
@@ -220,6 +235,45 @@ void luaswift_lua_Debug_gettransfers(const lua_Debug* d, unsigned short *ftransf
 #define LUASWIFT_GCINC LUA_GCINC
 #endif
 
+#define LUASWIFT_COLUMN_INTEGER 0
+#define LUASWIFT_COLUMN_NUMBER 1
+#define LUASWIFT_COLUMN_STRING 2
+
+typedef struct luaswift_StringSlice {
+    const char *ptr;
+    size_t len;
+} luaswift_StringSlice;
+
+typedef struct luaswift_Column {
+    int type; // One of the LUASWIFT_COLUMN_* values
+    void *values; // lua_Integer*, lua_Number* or luaswift_StringSlice*, with room for nrows elements
+} luaswift_Column;
+
+lua_Integer luaswift_tocolumns(lua_State *L, int index, lua_Integer nrows, luaswift_Column *columns, int ncolumns);
+
+#define LUASWIFT_BATCH_STOP 0
+#define LUASWIFT_BATCH_SKIP 1
+#define LUASWIFT_BATCH_COLLECT 2
+int luaswift_callbatch(lua_State *L);
+
+#define LUASWIFT_PATH_OK 0
+#define LUASWIFT_PATH_NIL 1
+#define LUASWIFT_PATH_NOTINDEXABLE 2
+int luaswift_getpath(lua_State *L);
+
+// The values stored (after the LuaSwift userdata header) in the userdata created by the vector library. See
+// LuaVectors.swift.
+typedef struct luaswift_Vector {
+    lua_Integer n; // 2, 3 or 4
+    lua_Number v[4];
+} luaswift_Vector;
+
+typedef struct luaswift_Matrix4 {
+    lua_Number m[16]; // Column-major
+} luaswift_Matrix4;
+
+void luaswift_openvectorlib(lua_State *L, size_t headersize);
+
 int luaswift_setgen(lua_State* L, int minormul, int majormul);
 int luaswift_setinc(lua_State* L, int pause, int stepmul, int stepsize);
 
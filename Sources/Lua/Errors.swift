@@ -1,6 +1,8 @@
 // Copyright (c) 2023 Tom Sutcliffe
 // See LICENSE file for license information.
 
+import CLua
+
 /// An `Error` type representing an error thrown by the Lua runtime.
 ///
 /// This type's implementation of `Pushable` pushes the underlying error object (or string).
@@ -9,22 +11,33 @@ public struct LuaCallError: Error, Equatable, CustomStringConvertible, Pushable
         self.errorValue = error
         // Construct this now in case the Error is not examined until the after the LuaState has gone out of scope
         // (at which point you'll at least be able to still use the string version)
-        self.errorString = error.tostring(convert: true) ?? "<no error description available>"
+        self.message = error.tostring(convert: true) ?? "<no error description available>"
+        self.traceback = nil
     }
 
     /// Construct a `LuaCallError` with a string error. `errorValue` will be nil.
     public init(_ error: String) {
+        self.init(error, traceback: nil)
+    }
+
+    private init(_ error: String, traceback: LuaTraceback?) {
         self.errorValue = nil
-        self.errorString = error
+        self.message = error
+        self.traceback = traceback
     }
 
     /// Pops a value from the stack and constructs a `LuaCallError` from it.
     public static func popFromStack(_ L: LuaState) -> LuaCallError {
+        return popFromStack(L, traceback: nil)
+    }
+
+    // As above, attaching a lazily-captured traceback (if there is one) to a string error.
+    internal static func popFromStack(_ L: LuaState, traceback: LuaTraceback?) -> LuaCallError {
         defer {
             L.pop()
         }
         if L.type(-1) == .string {
-            return LuaCallError(L.tostring(-1)!)
+            return LuaCallError(L.tostring(-1)!, traceback: traceback)
         } else {
             return LuaCallError(L.ref(index: -1))
         }
@@ -38,19 +51,127 @@ public struct LuaCallError: Error, Equatable, CustomStringConvertible, Pushable
         }
     }
 
+    public static func == (lhs: LuaCallError, rhs: LuaCallError) -> Bool {
+        return lhs.errorValue == rhs.errorValue && lhs.errorString == rhs.errorString
+    }
+
     /// The underlying Lua error object that was thrown by `lua_error()`, if the object thrown was something other than
     /// a string. For string errors, `errorValue` will be nil. Note like all `LuaValue`s, this is only valid until the
     /// `LuaState` that created it is closed. After that point, only `errorString` can be used.
     public let errorValue: LuaValue?
 
+    private let message: String
+    private let traceback: LuaTraceback?
+
     /// The string representation of the Lua error object. If the thrown error object was a string, this is that object
     /// as a Swift String. Otherwise, `errorString` will be set from the result of `tostring(errorValue)`.
-    public let errorString: String
+    ///
+    /// If the error was captured with a lazy traceback (see
+    /// ``Lua/Swift/UnsafeMutablePointer/setLazyTraceback(_:)``), the traceback is formatted and appended the first
+    /// time this is accessed.
+    public var errorString: String {
+        if let traceback {
+            return message + "\n" + traceback.formatted
+        } else {
+            return message
+        }
+    }
 
     // Conformance to CustomStringConvertible
     public var description: String { return errorString }
 }
 
+// The stack frames captured by defaultTracebackFn when lazy tracebacks are enabled. Formatting them is deferred until
+// the string is actually needed. The output matches luaL_traceback(), except that functions are only ever named
+// according to how they were called (eg "global 'error'"), because searching package.loaded for a global name is one
+// of the more expensive parts of luaL_traceback.
+internal final class LuaTraceback {
+    // Same as LEVELS1 and LEVELS2 in lauxlib.c
+    private static let levels1 = 10
+    private static let levels2 = 11
+
+    private struct Frame {
+        // Only the what, namewhat, currentline, linedefined, istailcall and short_src fields are valid. short_src is
+        // stored inline in lua_Debug and what and namewhat always point to static strings, so they remain valid after
+        // the LuaState is closed. name does not, which is why it is copied out.
+        let ar: lua_Debug
+        let name: String?
+    }
+
+    private let frames: [Frame]
+    // The number of frames omitted between frames[levels1 - 1] and frames[levels1]
+    private let skipped: Int
+
+    init(_ L: LuaState, level: CInt) {
+        var ar = lua_Debug()
+        var last = level
+        while lua_getstack(L, last, &ar) != 0 {
+            last = last + 1
+        }
+        let count = Int(last - level)
+        var frames: [Frame] = []
+        var skipped = 0
+        if count > Self.levels1 + Self.levels2 {
+            skipped = count - Self.levels1 - Self.levels2
+        }
+        frames.reserveCapacity(count - skipped)
+        for i in 0 ..< count {
+            if skipped > 0 && i >= Self.levels1 && i < Self.levels1 + skipped {
+                continue
+            }
+            if lua_getstack(L, level + CInt(i), &ar) != 0 && lua_getinfo(L, "Slnt", &ar) != 0 {
+                let name = ar.namewhat.pointee != 0 ? ar.name.map { String(cString: $0) } : nil
+                frames.append(Frame(ar: ar, name: name))
+            }
+        }
+        self.frames = frames
+        self.skipped = skipped
+    }
+
+    private var cachedString: String? = nil
+
+    var formatted: String {
+        if let cachedString {
+            return cachedString
+        }
+        var result = "stack traceback:"
+        for (i, frame) in frames.enumerated() {
+            if skipped > 0 && i == Self.levels1 {
+                result.append("\n\t...\t(skipping \(skipped) levels)")
+            }
+            let ar = frame.ar
+            let src = withUnsafeBytes(of: ar.short_src) { rawbuf in
+                rawbuf.withMemoryRebound(to: CChar.self) { buf in
+                    var arr = Array<CChar>(buf)
+                    arr.append(0) // Ensure null terminated
+                    return String(cString: arr)
+                }
+            }
+            result.append("\n\t\(src):")
+            if ar.currentline > 0 {
+                result.append("\(ar.currentline):")
+            }
+            if let name = frame.name {
+                result.append(" in \(String(cString: ar.namewhat)) '\(name)'")
+            } else {
+                switch ar.what.pointee {
+                case CChar(UInt8(ascii: "m")):
+                    result.append(" in main chunk")
+                case CChar(UInt8(ascii: "C")):
+                    result.append(" in ?")
+                default:
+                    result.append(" in function <\(src):\(ar.linedefined)>")
+                }
+            }
+            if ar.istailcall != 0 {
+                result.append("\n\t(...tail calls...)")
+            }
+        }
+        cachedString = result
+        return result
+    }
+}
+
 /// Errors than can be thrown by ``Lua/Swift/UnsafeMutablePointer/load(file:displayPath:mode:)`` (and other overloads).
 ///
 /// This type's implementation of `Pushable` pushes the underlying error string.
@@ -0,0 +1,144 @@
+// Copyright (c) 2023 Tom Sutcliffe
+// See LICENSE file for license information.
+
+import CLua
+
+/// How ``LuaValue/pcall(batch:onError:traceback:)`` handles a call which errors.
+public enum LuaBatchErrorPolicy {
+    /// The first error aborts the whole batch, and is thrown.
+    case stop
+    /// Elements whose call errored have a `nil` result, and the error is discarded.
+    case skip
+    /// Elements whose call errored have a `nil` result, and the error is returned in ``LuaBatchResult/errors``.
+    case collect
+}
+
+/// The result of ``LuaValue/pcall(batch:onError:traceback:)``.
+public struct LuaBatchResult<Result> {
+    /// The first result of each call, in the same order as the elements of the batch.
+    ///
+    /// An entry is `nil` if the call errored, or if its result could not be converted to `Result`.
+    public let results: [Result?]
+
+    /// The errors thrown by each call which errored, keyed by the offset of the element in the batch.
+    ///
+    /// Always empty unless the error policy was ``LuaBatchErrorPolicy/collect``.
+    public let errors: [Int: LuaCallError]
+}
+
+extension LuaValue {
+    /// Call this value once for each element of a collection.
+    ///
+    /// This is equivalent to calling ``pcall(_:traceback:)`` once for each of `elements`, but is much more efficient
+    /// for large numbers of cheap calls because the elements are all pushed up front and the loop making the calls is
+    /// implemented in C, within a single protected call. For example:
+    ///
+    /// ```swift
+    /// try L.dostring("function score(x) return x * 2 end")
+    /// let scores: LuaBatchResult<Int> = try L.globals["score"].pcall(batch: [1, 2, 3])
+    /// // scores.results == [2, 4, 6]
+    /// ```
+    ///
+    /// Each call is passed a single argument (the element) and the first result of each call is converted to `Result`
+    /// using the same rules as ``Lua/Swift/UnsafeMutablePointer/tovalue(_:)``.
+    ///
+    /// - Parameter elements: The argument for each call.
+    /// - Parameter policy: What to do if a call errors.
+    /// - Parameter traceback: If true, any errors thrown or collected will include a full stack trace.
+    /// - Returns: The results of the calls.
+    /// - Throws: ``LuaValueError/notCallable`` if this value is not callable, ``LuaValueError/nilValue`` if this value
+    ///   is `nil`, or ``LuaCallError`` if a call errors and `policy` is ``LuaBatchErrorPolicy/stop``.
+    public func pcall<Elements: Collection, Result>(batch elements: Elements, onError policy: LuaBatchErrorPolicy = .stop,
+                                                   traceback: Bool = true) throws -> LuaBatchResult<Result>
+                                                   where Elements.Element: Pushable {
+        guard valid() else {
+            throw LuaValueError.nilValue
+        }
+        let top = L.gettop()
+        defer {
+            L.settop(top)
+        }
+        L.checkstack(6)
+        L.push(function: luaswift_callbatch)
+        push(onto: L)
+        try Self.checkTopIsCallable(L)
+
+        lua_createtable(L, CInt(clamping: elements.count), 0)
+        var n: lua_Integer = 0
+        for element in elements {
+            element.push(onto: L)
+            n = n + 1
+            lua_rawseti(L, -2, n)
+        }
+        L.push(n)
+        switch policy {
+        case .stop:
+            L.push(LUASWIFT_BATCH_STOP)
+        case .skip:
+            L.push(LUASWIFT_BATCH_SKIP)
+        case .collect:
+            L.push(LUASWIFT_BATCH_COLLECT)
+        }
+        // Skipped errors are discarded, so there's no point generating tracebacks for them.
+        if traceback && policy == .collect {
+            L.push(function: defaultTracebackFn)
+        } else {
+            L.pushnil()
+        }
+        var tracebacks: ArraySlice<LuaTraceback> = []
+        if traceback && policy == .collect, let state = L.extraSpaceState(), state.lazyTraceback {
+            // The errors are caught inside luaswift_callbatch rather than propagating out of this call, so their
+            // lazy tracebacks have to be claimed here rather than by pcall().
+            let mark = state.beginTracebackCapture()
+            let err = lua_pcall(L, 5, 2, 0)
+            tracebacks = state.endTracebackCapture(mark)
+            if err != LUA_OK {
+                throw LuaCallError.popFromStack(L)
+            }
+        } else {
+            try L.pcall(nargs: 5, nret: 2, traceback: traceback)
+        }
+
+        let resultsIndex = top + 1
+        let errorsIndex = top + 2
+        var results: [Result?] = []
+        results.reserveCapacity(Int(n))
+        for i in 1 ..< n + 1 {
+            lua_rawgeti(L, resultsIndex, i)
+            if let val: Result = L.checkArgumentFastPath(-1) {
+                results.append(val)
+            } else {
+                results.append(L.tovalue(-1))
+            }
+            L.pop()
+        }
+
+        // Each captured traceback belongs to one string error, in order - unless something else (such as a raw
+        // lua_pcall() in a __close metamethod) captured one too, in which case there's no telling which is which.
+        if !tracebacks.isEmpty {
+            var stringErrors = 0
+            for i in 1 ..< n + 1 {
+                lua_rawgeti(L, errorsIndex, i)
+                if L.type(-1) == .string {
+                    stringErrors = stringErrors + 1
+                }
+                L.pop()
+            }
+            if stringErrors != tracebacks.count {
+                tracebacks = []
+            }
+        }
+
+        var errors: [Int: LuaCallError] = [:]
+        for i in 1 ..< n + 1 {
+            lua_rawgeti(L, errorsIndex, i)
+            if L.isnil(-1) {
+                L.pop()
+            } else {
+                let captured = L.type(-1) == .string ? tracebacks.popFirst() : nil
+                errors[Int(i - 1)] = LuaCallError.popFromStack(L, traceback: captured)
+            }
+        }
+        return LuaBatchResult(results: results, errors: errors)
+    }
+}
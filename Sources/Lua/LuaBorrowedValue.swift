@@ -0,0 +1,96 @@
+// Copyright (c) 2023 Tom Sutcliffe
+// See LICENSE file for license information.
+
+import CLua
+
+/// A handle to a value on the Lua stack, which is only valid for a limited time.
+///
+/// `LuaBorrowedValue` is used by the borrowed iteration functions such as ``LuaValue/for_pairs(borrowed:)`` and
+/// ``LuaValue/for_ipairs(start:borrowed:)``. Unlike ``LuaValue``, creating one does not create a registry ref, so
+/// iterating a table with a million entries does not create (and later release) two million refs. The tradeoff is
+/// that a `LuaBorrowedValue` refers directly to a stack slot, and is only valid within the block it was passed to.
+/// Use ``ref()`` to get a `LuaValue` that can be stored or used after the block has returned:
+///
+/// ```swift
+/// var bigValues: [LuaValue] = []
+/// try tbl.for_pairs(borrowed: { key, value in
+///     if let n = value.toint(), n > 1000 {
+///         bigValues.append(value.ref())
+///     }
+///     return true
+/// })
+/// ```
+///
+/// A `LuaBorrowedValue` must not be stored or used outside of the block it was passed to, and the block must leave
+/// the Lua stack as it found it.
+public struct LuaBorrowedValue: Pushable {
+    internal let L: LuaState
+
+    /// The absolute stack index of the value.
+    public let index: CInt
+
+    internal init(L: LuaState, index: CInt) {
+        self.L = L
+        self.index = index
+    }
+
+    /// The type of the value.
+    public var type: LuaType {
+        return L.type(index)!
+    }
+
+    /// Returns a `LuaValue` representing the same value, which remains valid after the borrowed value is not.
+    public func ref() -> LuaValue {
+        return L.ref(index: index)
+    }
+
+    public func push(onto L: LuaState) {
+        checkRelated(self.L, L, "Cannot push a LuaBorrowedValue onto an unrelated state")
+        lua_pushvalue(self.L, index)
+        if L != self.L {
+            lua_xmove(self.L, L, 1)
+        }
+    }
+
+    // MARK: - to...() functions
+
+    public func toboolean() -> Bool {
+        return L.toboolean(index)
+    }
+
+    public func tointeger() -> lua_Integer? {
+        return L.tointeger(index)
+    }
+
+    public func toint() -> Int? {
+        return L.toint(index)
+    }
+
+    public func tonumber() -> lua_Number? {
+        return L.tonumber(index)
+    }
+
+    public func todata() -> [UInt8]? {
+        return L.todata(index)
+    }
+
+    public func tostring(convert: Bool = false) -> String? {
+        return L.tostring(index, convert: convert)
+    }
+
+    public func toany(guessType: Bool = true) -> Any? {
+        return L.toany(index, guessType: guessType)
+    }
+
+    public func tovalue<T>() -> T? {
+        return L.tovalue(index)
+    }
+
+    public func tovalue<T>(type: T.Type) -> T? {
+        return L.tovalue(index)
+    }
+
+    public func touserdata<T>() -> T? {
+        return L.touserdata(index)
+    }
+}
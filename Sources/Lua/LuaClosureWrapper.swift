@@ -46,7 +46,7 @@ public class LuaClosureWrapper: Pushable {
         return lua_upvalueindex(NumInternalUpvalues + i)
     }
 
-    // This is only optional because of the nonescaping requirements in for_pairs/for_ipairs
+    // Optional so that the closure can be explicitly released while the wrapper is still reachable from Lua
     var _closure: Optional<LuaClosure>
 
     public var closure: LuaClosure {
@@ -58,7 +58,10 @@ public class LuaClosureWrapper: Pushable {
     }
 
     private static let callClosure: lua_CFunction = { (L: LuaState!) -> CInt in
-        let wrapper: LuaClosureWrapper = L.touserdata(lua_upvalueindex(1))!
+        // Upvalue 1 is always the userdata created by push(onto:numUpvalues:), which stores a LuaClosureWrapper
+        // directly after the userdata header, so there is no need for the type checks in touserdata().
+        let udata = lua_touserdata(L, lua_upvalueindex(1)).unsafelyUnwrapped
+        let wrapper = (udata + LuaState.UserdataHeaderSize).assumingMemoryBound(to: LuaClosureWrapper.self).pointee
         guard let closure = wrapper._closure else {
             fatalError("Attempt to call a LuaClosureWrapper after it has been explicitly nilled")
         }
@@ -71,19 +74,20 @@ public class LuaClosureWrapper: Pushable {
         }
     }
 
+    // luaswift_callclosurewrapper calls callClosure via a static function pointer, which only needs setting once.
+    private static let callClosureRegistered: Void = {
+        luaswift_setcallclosurewrapperimpl(callClosure)
+    }()
+
     public func push(onto L: LuaState) {
         push(onto: L, numUpvalues: 0)
     }
 
     public func push(onto L: LuaState, numUpvalues: CInt) {
         precondition(numUpvalues >= 0 && numUpvalues <= 255 - Self.NumInternalUpvalues)
+        _ = Self.callClosureRegistered
 
-        // This only technically needs doing once but it's easier to just do it every time.
-        L.push(function: luaswift_callclosurewrapper)
-        L.push(function: Self.callClosure)
-        L.rawset(LUA_REGISTRYINDEX)
-
-        L.push(userdata: self)
+        L.pushuserdata(self as LuaClosureWrapper)
         // Move these below numUpvalues
         if numUpvalues > 0 {
             lua_rotate(L, -(numUpvalues + Self.NumInternalUpvalues), Self.NumInternalUpvalues)
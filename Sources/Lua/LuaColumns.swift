@@ -0,0 +1,141 @@
+// Copyright (c) 2023 Tom Sutcliffe
+// See LICENSE file for license information.
+
+import CLua
+
+/// The type of a column extracted by ``Lua/Swift/UnsafeMutablePointer/tocolumns(_:schema:)``.
+public enum LuaColumnType {
+    /// Values must be Lua numbers representable as a `lua_Integer`.
+    case integer
+    /// Values must be Lua numbers.
+    case number
+    /// Values must be Lua strings containing valid UTF-8.
+    case string
+}
+
+/// The result of ``Lua/Swift/UnsafeMutablePointer/tocolumns(_:schema:)``.
+///
+/// Each column from the schema appears in exactly one of ``integers``, ``numbers`` or ``strings`` according to its
+/// ``LuaColumnType``, and every column contains ``count`` elements.
+public struct LuaColumns {
+    /// The number of records (ie rows) that were extracted.
+    public let count: Int
+    /// The columns of type ``LuaColumnType/integer``, keyed by field name.
+    public fileprivate(set) var integers: [String: [lua_Integer]] = [:]
+    /// The columns of type ``LuaColumnType/number``, keyed by field name.
+    public fileprivate(set) var numbers: [String: [lua_Number]] = [:]
+    /// The columns of type ``LuaColumnType/string``, keyed by field name.
+    public fileprivate(set) var strings: [String: [String]] = [:]
+
+    fileprivate init(count: Int) {
+        self.count = count
+    }
+}
+
+extension UnsafeMutablePointer where Pointee == lua_State {
+
+    /// Convert an array of records into a set of columns.
+    ///
+    /// The value at `index` must be a table whose array part (as per ``rawlen(_:)``) consists of tables (the
+    /// records), each of which has a field for every name in `schema` of the appropriate ``LuaColumnType``. The
+    /// fields are extracted in a single pass into contiguous arrays, one per schema entry. For example:
+    ///
+    /// ```swift
+    /// try L.dostring("return { { ts = 1, v = 1.5 }, { ts = 2, v = 2.5 } }")
+    /// let columns = L.tocolumns(-1, schema: ["ts": .integer, "v": .number])!
+    /// // columns.integers["ts"] == [1, 2]
+    /// // columns.numbers["v"] == [1.5, 2.5]
+    /// ```
+    ///
+    /// This is considerably more efficient than converting the table to `[[String: Any]]` with ``tovalue(_:)`` and
+    /// then transposing it. Records are accessed using raw accesses, so no metamethods are invoked. Extra fields in
+    /// the records are ignored. String values are always decoded as UTF-8, regardless of the default string encoding.
+    ///
+    /// - Parameter index: The stack index of the table.
+    /// - Parameter schema: The names and types of the fields to extract.
+    /// - Returns: The extracted columns, or `nil` if the value at `index` is not a table, or if any record is not a
+    ///   table, is missing a field from `schema`, or has a field whose value cannot be represented as the column type.
+    public func tocolumns(_ index: CInt, schema: KeyValuePairs<String, LuaColumnType>) -> LuaColumns? {
+        guard type(index) == .table else {
+            return nil
+        }
+        let absidx = absindex(index)
+        let nrows = Int(lua_rawlen(self, absidx))
+        let top = gettop()
+        defer {
+            settop(top)
+        }
+        checkstack(CInt(schema.count) + 2)
+        for (name, _) in schema {
+            push(utf8String: name)
+        }
+
+        var columns: [luaswift_Column] = []
+        columns.reserveCapacity(schema.count)
+        var result = LuaColumns(count: nrows)
+        guard tocolumns(absidx, nrows: nrows, schema: Array(schema), columns: &columns, result: &result) else {
+            return nil
+        }
+        return result
+    }
+
+    // Sets up the column for schema[columns.count] and recurses to set up the rest, with the final call filling in
+    // every column in a single pass. Integer and number columns are filled in directly in the storage of the arrays
+    // which end up in result, which is why this has to nest one closure per column: an array's buffer is only valid
+    // within unsafeUninitializedCapacity's closure. Returns false if any row could not be converted.
+    private func tocolumns(_ absidx: CInt, nrows: Int, schema: [(String, LuaColumnType)],
+                           columns: inout [luaswift_Column], result: inout LuaColumns) -> Bool {
+        let c = columns.count
+        if c == schema.count {
+            let failedRow = columns.withUnsafeMutableBufferPointer { buf in
+                return luaswift_tocolumns(self, absidx, lua_Integer(nrows), buf.baseAddress, CInt(buf.count))
+            }
+            return failedRow == 0
+        }
+
+        let (name, columnType) = schema[c]
+        var ok = false
+        switch columnType {
+        case .integer:
+            let values = [lua_Integer](unsafeUninitializedCapacity: nrows) { buf, initializedCount in
+                columns.append(luaswift_Column(type: LUASWIFT_COLUMN_INTEGER,
+                                               values: UnsafeMutableRawPointer(buf.baseAddress)))
+                ok = tocolumns(absidx, nrows: nrows, schema: schema, columns: &columns, result: &result)
+                initializedCount = ok ? nrows : 0
+            }
+            result.integers[name] = values
+        case .number:
+            let values = [lua_Number](unsafeUninitializedCapacity: nrows) { buf, initializedCount in
+                columns.append(luaswift_Column(type: LUASWIFT_COLUMN_NUMBER,
+                                               values: UnsafeMutableRawPointer(buf.baseAddress)))
+                ok = tocolumns(absidx, nrows: nrows, schema: schema, columns: &columns, result: &result)
+                initializedCount = ok ? nrows : 0
+            }
+            result.numbers[name] = values
+        case .string:
+            // Scratch space for the slices, which point into strings owned by the table at absidx (which stays on
+            // the stack for the duration).
+            let slices = UnsafeMutableBufferPointer<luaswift_StringSlice>.allocate(capacity: nrows)
+            defer {
+                slices.deallocate()
+            }
+            columns.append(luaswift_Column(type: LUASWIFT_COLUMN_STRING, values: UnsafeMutableRawPointer(slices.baseAddress)))
+            ok = tocolumns(absidx, nrows: nrows, schema: schema, columns: &columns, result: &result)
+            if !ok {
+                return false
+            }
+            var strings: [String] = []
+            strings.reserveCapacity(nrows)
+            for slice in slices {
+                // Lua strings are always null terminated, so validatingUTF8 is safe providing we check for
+                // embedded nulls by comparing the lengths.
+                guard let str = String(validatingUTF8: slice.ptr), str.utf8.count == slice.len else {
+                    return false
+                }
+                strings.append(str)
+            }
+            result.strings[name] = strings
+        }
+        return ok
+    }
+}
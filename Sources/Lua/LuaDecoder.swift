@@ -17,14 +17,6 @@ struct LuaDecoder: Decoder, SingleValueDecodingContainer {
         self.codingPath = codingPath
     }
 
-    func push(key: CodingKey) {
-        if let intVal = key.intValue {
-            L.push(intVal)
-        } else {
-            L.push(key.stringValue)
-        }
-    }
-
     func checkType(_ swiftType: Any.Type, _ luaType: LuaType, index: CInt? = nil) throws {
         let actualType = L.type(index ?? self.index) ?? .nil // None shouldn't happen here, treat like nil
         if actualType != luaType {
@@ -182,6 +174,11 @@ struct LuaDecoder: Decoder, SingleValueDecodingContainer {
     struct KeyedContainer<Key: CodingKey>: KeyedDecodingContainerProtocol {
         let decoder: LuaDecoder
         var codingPath: [CodingKey]
+        // If the table has no metatable, lookups cannot invoke metamethods and so can use lua_rawget instead of a
+        // protected lua_gettable.
+        private let raw: Bool
+        private let keyPlan: KeyPlan
+
         var allKeys: [Key] {
             let L = decoder.L
             var result: [Key] = []
@@ -203,11 +200,34 @@ struct LuaDecoder: Decoder, SingleValueDecodingContainer {
         init(decoder: LuaDecoder) {
             self.decoder = decoder
             self.codingPath = decoder.codingPath
+            let L = decoder.L
+            if lua_getmetatable(L, decoder.index) == 0 {
+                self.raw = true
+            } else {
+                L.pop()
+                self.raw = false
+            }
+            self.keyPlan = L.getState().decoderKeyPlan(for: Key.self, L)
         }
 
-        func decoderForKey<LocalKey: CodingKey>(_ key: LocalKey) throws -> LuaDecoder {
-            decoder.push(key: key)
-            try decoder.L.get(decoder.index)
+        // Pushes the value of `key` in the table on to the stack, and returns its type.
+        @discardableResult
+        private func pushValue(forKey key: Key) throws -> LuaType {
+            let L = decoder.L
+            if let intVal = key.intValue {
+                L.push(intVal)
+            } else {
+                keyPlan.push(key: key.stringValue, onto: L)
+            }
+            if raw {
+                return LuaType(ctype: lua_rawget(L, decoder.index))!
+            } else {
+                return try L.get(decoder.index)
+            }
+        }
+
+        func decoderForKey(_ key: Key) throws -> LuaDecoder {
+            try pushValue(forKey: key)
             var newPath = self.codingPath
             newPath.append(key)
             return decoder.nestedDecoderForIndex(-1, codingPath: newPath)
@@ -224,8 +244,7 @@ struct LuaDecoder: Decoder, SingleValueDecodingContainer {
         }
 
         func contains(_ key: Key) -> Bool {
-            decoder.push(key: key)
-            let t = try? decoder.L.get(decoder.index)
+            let t = try? pushValue(forKey: key)
             if let t {
                 decoder.L.pop() // the result
                 return t != .nil
@@ -317,6 +336,45 @@ struct LuaDecoder: Decoder, SingleValueDecodingContainer {
         }
     }
 
+    /// Caches the Lua strings for the keys of one `CodingKey` type, so that decoding many values of the same type
+    /// does not re-encode and re-intern every key string for every field. Plans are per-state and are owned by
+    /// `_State`.
+    ///
+    /// Not every `CodingKey` type has a fixed set of keys (for example, `Dictionary` decodes using a key type which
+    /// can take any string), so a plan only caches the first `maxKeys` distinct keys it sees, and pushes any others
+    /// directly.
+    final class KeyPlan {
+        static let maxKeys = 128
+
+        // Registry ref of a table mapping slot number to key string
+        let ref: CInt
+        private var slots: [String: lua_Integer] = [:]
+
+        init(_ L: LuaState) {
+            lua_newtable(L)
+            ref = luaL_ref(L, LUA_REGISTRYINDEX)
+        }
+
+        func push(key: String, onto L: LuaState) {
+            let slot = slots[key]
+            if slot == nil && slots.count >= Self.maxKeys {
+                L.push(key)
+                return
+            }
+            lua_rawgeti(L, LUA_REGISTRYINDEX, lua_Integer(ref))
+            if let slot {
+                lua_rawgeti(L, -1, slot)
+            } else {
+                let slot = lua_Integer(slots.count + 1)
+                L.push(key)
+                lua_pushvalue(L, -1)
+                lua_rawseti(L, -3, slot)
+                slots[key] = slot
+            }
+            lua_remove(L, -2)
+        }
+    }
+
     struct UnkeyedContainer: UnkeyedDecodingContainer {
         private let decoder: LuaDecoder
         private var idx: lua_Integer = 1
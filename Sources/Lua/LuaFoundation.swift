@@ -97,7 +97,13 @@ extension UnsafeMutablePointer where Pointee == lua_State {
     ///
     /// If this function is not called, the default encoding is UTF-8. See also ``getDefaultStringEncoding()``.
     public func setDefaultStringEncoding(_ encoding: LuaStringEncoding) {
-        getState().defaultStringEncoding = encoding
+        let state = getState()
+        state.defaultStringEncoding = encoding
+        // Cached decoder key strings were encoded with the previous encoding
+        for (_, plan) in state.decoderKeyPlans {
+            luaL_unref(self, LUA_REGISTRYINDEX, plan.ref)
+        }
+        state.decoderKeyPlans = [:]
     }
 
     /// Get the default string encoding.
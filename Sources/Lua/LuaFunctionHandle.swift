@@ -0,0 +1,192 @@
+// Copyright (c) 2023 Tom Sutcliffe
+// See LICENSE file for license information.
+
+import CLua
+
+/// A prepared handle for efficiently calling the same Lua function many times.
+///
+/// Calling a function via ``LuaValue/pcall(arguments:traceback:)`` has to box every argument in an `Any?`, dynamically
+/// determine how to push each one, check that the value is callable, and convert the result via the general-purpose
+/// ``Lua/Swift/UnsafeMutablePointer/tovalue(_:)``. `LuaFunctionHandle` does all of the work that does not depend on
+/// the argument values once, when the handle is created: the callee is validated, the argument types are fixed (and
+/// pushed via their `Pushable` conformances without any boxing) and the strategy for converting the result is
+/// chosen up front.
+///
+/// Handles are created with one of the `prepare()` functions on `LuaValue`, which take the argument types. When there
+/// is more than one argument, `Args` is a tuple and must be passed as such:
+///
+/// ```swift
+/// try L.dostring("function add(a, b) return a + b end")
+/// let add: LuaFunctionHandle<(Int, Int), Int> = try L.globals["add"].prepare(Int.self, Int.self)
+/// let result = try add((1, 2)) // result is Optional(3)
+/// ```
+///
+/// If the handle was created with `traceback: true` and the calling thread has a message handler installed by
+/// ``Lua/Swift/UnsafeMutablePointer/pushResidentMessageHandler()``, calls use that handler where it is on the stack,
+/// so that calling the handle never has to push a message handler. Otherwise, each call pushes the message handler
+/// below the function, which still avoids moving the function and arguments the way
+/// ``Lua/Swift/UnsafeMutablePointer/pcall(nargs:nret:msgh:)`` has to.
+///
+/// The handle holds a reference to the function, so it remains valid as long as the `LuaState` is. Calling a handle
+/// after the `LuaState` has been closed will throw ``LuaValueError/nilValue``.
+public final class LuaFunctionHandle<Args, Result> {
+    private enum ResultPlan {
+        case discard
+        case ref
+        case convert
+    }
+
+    private let function: LuaValue
+    private let nargs: CInt
+    private let msgh: lua_CFunction?
+    private let resultPlan: ResultPlan
+    private let pushArgs: (LuaState, Args) -> Void
+
+    internal init(function: LuaValue, nargs: CInt, traceback: Bool,
+                  pushArgs: @escaping (LuaState, Args) -> Void) throws {
+        guard function.valid() else {
+            throw LuaValueError.nilValue
+        }
+        if function.type != .function {
+            let L = function.L!
+            L.push(function)
+            try LuaValue.checkTopIsCallable(L)
+            L.pop()
+        }
+        self.function = function
+        self.nargs = nargs
+        self.msgh = traceback ? defaultTracebackFn : nil
+        self.pushArgs = pushArgs
+        if Result.self == Void.self {
+            resultPlan = .discard
+        } else if Result.self == LuaValue.self {
+            resultPlan = .ref
+        } else {
+            resultPlan = .convert
+        }
+    }
+
+    /// Call the function.
+    ///
+    /// - Parameter args: The arguments to pass to the function. If there is more than one argument, this is a tuple.
+    /// - Returns: The first result of the function converted to `Result` using the same rules as
+    ///   ``Lua/Swift/UnsafeMutablePointer/tovalue(_:)``, or `nil` if it could not be converted. If `Result` is `Void`,
+    ///   any results are discarded.
+    /// - Throws: ``LuaCallError`` if a Lua error is raised during the execution of the function, or
+    ///   ``LuaValueError/nilValue`` if the `LuaState` has been closed.
+    @discardableResult
+    public func callAsFunction(_ args: Args) throws -> Result? {
+        guard let L = function.L else {
+            throw LuaValueError.nilValue
+        }
+        let top = lua_gettop(L)
+        defer {
+            lua_settop(L, top)
+        }
+        L.checkstack(nargs + 2)
+        // Pushing the message handler first means it is already in place below the function, rather than having to
+        // be inserted (and removed again afterwards) the way pcall(nargs:nret:msgh:) does. Better still is a resident
+        // handler, which is already somewhere below the function (nargs: -1 because nothing is pushed yet).
+        let msghIndex: CInt
+        if msgh != nil, let index = L.residentMessageHandlerIndex(nargs: -1) {
+            msghIndex = index
+        } else if let msgh {
+            lua_pushcfunction(L, msgh)
+            msghIndex = top + 1
+        } else {
+            msghIndex = 0
+        }
+        function.push(onto: L)
+        pushArgs(L, args)
+        let nret: CInt = resultPlan == .discard ? 0 : 1
+        if msghIndex != 0 {
+            try L.pcall(nargs: nargs, nret: nret, tracebackIndex: msghIndex)
+        } else {
+            try L.pcall(nargs: nargs, nret: nret, msgh: nil)
+        }
+        switch resultPlan {
+        case .discard:
+            return (() as Any) as? Result
+        case .ref:
+            return L.ref(index: -1) as? Result
+        case .convert:
+            if let val: Result = L.checkArgumentFastPath(-1) {
+                return val
+            }
+            return L.tovalue(-1)
+        }
+    }
+}
+
+extension LuaFunctionHandle where Args == Void {
+    /// Call a function which takes no arguments.
+    ///
+    /// See ``callAsFunction(_:)``.
+    @discardableResult
+    public func callAsFunction() throws -> Result? {
+        return try callAsFunction(())
+    }
+}
+
+extension LuaValue {
+    /// Create a ``LuaFunctionHandle`` for calling this value with no arguments.
+    ///
+    /// - Parameter returning: The type to convert the function's first result to. Use `Void` to discard any results.
+    /// - Parameter traceback: If true, any errors thrown by calls made using the handle will include a full stack trace.
+    /// - Returns: A handle which can be used to call the function.
+    /// - Throws: ``LuaValueError/notCallable`` if the value is not a function and does not have a `__call` metamethod,
+    ///   or ``LuaValueError/nilValue`` if the value is `nil`.
+    public func prepare<Result>(returning: Result.Type = Result.self, traceback: Bool = true) throws -> LuaFunctionHandle<Void, Result> {
+        return try LuaFunctionHandle(function: self, nargs: 0, traceback: traceback, pushArgs: { _, _ in })
+    }
+
+    /// Create a ``LuaFunctionHandle`` for calling this value with one argument.
+    ///
+    /// See ``prepare(returning:traceback:)``.
+    public func prepare<Arg1: Pushable, Result>(_ arg1: Arg1.Type, returning: Result.Type = Result.self,
+                                                traceback: Bool = true) throws -> LuaFunctionHandle<Arg1, Result> {
+        return try LuaFunctionHandle(function: self, nargs: 1, traceback: traceback, pushArgs: { L, arg in
+            arg.push(onto: L)
+        })
+    }
+
+    /// Create a ``LuaFunctionHandle`` for calling this value with two arguments.
+    ///
+    /// See ``prepare(returning:traceback:)``.
+    public func prepare<Arg1: Pushable, Arg2: Pushable, Result>(_ arg1: Arg1.Type, _ arg2: Arg2.Type,
+                                                                returning: Result.Type = Result.self,
+                                                                traceback: Bool = true) throws -> LuaFunctionHandle<(Arg1, Arg2), Result> {
+        return try LuaFunctionHandle(function: self, nargs: 2, traceback: traceback, pushArgs: { L, args in
+            args.0.push(onto: L)
+            args.1.push(onto: L)
+        })
+    }
+
+    /// Create a ``LuaFunctionHandle`` for calling this value with three arguments.
+    ///
+    /// See ``prepare(returning:traceback:)``.
+    public func prepare<Arg1: Pushable, Arg2: Pushable, Arg3: Pushable, Result>(_ arg1: Arg1.Type, _ arg2: Arg2.Type,
+                                                                                _ arg3: Arg3.Type,
+                                                                                returning: Result.Type = Result.self,
+                                                                                traceback: Bool = true) throws -> LuaFunctionHandle<(Arg1, Arg2, Arg3), Result> {
+        return try LuaFunctionHandle(function: self, nargs: 3, traceback: traceback, pushArgs: { L, args in
+            args.0.push(onto: L)
+            args.1.push(onto: L)
+            args.2.push(onto: L)
+        })
+    }
+
+    /// Create a ``LuaFunctionHandle`` for calling this value with four arguments.
+    ///
+    /// See ``prepare(returning:traceback:)``.
+    public func prepare<Arg1: Pushable, Arg2: Pushable, Arg3: Pushable, Arg4: Pushable, Result>(
+        _ arg1: Arg1.Type, _ arg2: Arg2.Type, _ arg3: Arg3.Type, _ arg4: Arg4.Type,
+        returning: Result.Type = Result.self, traceback: Bool = true) throws -> LuaFunctionHandle<(Arg1, Arg2, Arg3, Arg4), Result> {
+        return try LuaFunctionHandle(function: self, nargs: 4, traceback: traceback, pushArgs: { L, args in
+            args.0.push(onto: L)
+            args.1.push(onto: L)
+            args.2.push(onto: L)
+            args.3.push(onto: L)
+        })
+    }
+}
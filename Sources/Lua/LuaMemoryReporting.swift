@@ -0,0 +1,63 @@
+// Copyright (c) 2023 Tom Sutcliffe
+// See LICENSE file for license information.
+
+import CLua
+
+/// A type whose values hold memory which the Lua garbage collector should take into account.
+///
+/// The Lua garbage collector decides how often to run based on how much memory Lua itself has allocated. A userdata
+/// created by ``Lua/Swift/UnsafeMutablePointer/push(userdata:toindex:)`` is tiny as far as Lua is concerned, even if
+/// the Swift value it contains keeps megabytes of memory alive (for example an image or a large buffer), so when
+/// lots of such values are created by Lua code the collector runs far less often than it should.
+///
+/// When a value whose dynamic type conforms to `LuaMemoryReporting` is pushed as a userdata, its
+/// ``luaExternalMemorySize`` is passed to ``Lua/Swift/UnsafeMutablePointer/reportExternalMemory(_:)``, so that the
+/// garbage collector's pace reflects the memory it is really keeping alive.
+///
+/// ```swift
+/// class Image: LuaMemoryReporting {
+///     let pixels: [UInt32]
+///     var luaExternalMemorySize: Int { pixels.count * MemoryLayout<UInt32>.stride }
+///     // ...
+/// }
+/// ```
+public protocol LuaMemoryReporting {
+    /// The approximate number of bytes of memory kept alive by this value, other than the value itself.
+    var luaExternalMemorySize: Int { get }
+}
+
+extension UnsafeMutablePointer where Pointee == lua_State {
+
+    /// Tell the garbage collector about memory which is kept alive by Lua values but was not allocated by Lua.
+    ///
+    /// Advances the garbage collector as if `bytes` bytes had been allocated by Lua (using the equivalent of
+    /// ``collectorStep(_:)``), so that objects which own a large amount of external memory are collected at a pace
+    /// which reflects that. Amounts are accumulated until they add up to at least 1KB, and to at least an eighth of the
+    /// memory currently in use by Lua, so that lots of small reports do not each cause a collector step (which in
+    /// generational mode means a whole minor collection). Has no effect if the garbage collector is stopped.
+    ///
+    /// This is called automatically by ``push(userdata:toindex:)`` for values which conform to
+    /// ``LuaMemoryReporting``, and can be called directly for any other situation where a Lua value is responsible
+    /// for external memory, for example after pushing a userdata with an explicitly known size.
+    ///
+    /// > Note: Do not call this API from within a finalizer, it will have no effect.
+    ///
+    /// - Parameter bytes: The number of bytes of external memory.
+    public func reportExternalMemory(_ bytes: Int) {
+        reportExternalMemory(bytes, state: getState())
+    }
+
+    internal func reportExternalMemory(_ bytes: Int, state: _State) {
+        guard bytes > 0, collectorRunning() else {
+            return
+        }
+        state.externalMemoryDebt += bytes
+        // Much as Lua paces itself by the growth of the heap rather than stepping on every allocation
+        guard state.externalMemoryDebt >= 1024, state.externalMemoryDebt >= collectorCount() / 8 else {
+            return
+        }
+        let kb = state.externalMemoryDebt / 1024
+        state.externalMemoryDebt -= kb * 1024
+        collectorStep(CInt(clamping: kb))
+    }
+}
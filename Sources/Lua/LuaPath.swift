@@ -0,0 +1,191 @@
+// Copyright (c) 2023 Tom Sutcliffe
+// See LICENSE file for license information.
+
+import CLua
+
+/// A sequence of keys for looking up a value nested several levels deep in tables (or other indexable values).
+///
+/// Looking up a nested value by chaining subscripts, such as `L.globals["config"]["limits"]["rps"]`, creates a
+/// `LuaValue` (and thus a registry ref) for every intermediate value, converts every key using
+/// ``Lua/Swift/UnsafeMutablePointer/push(any:toindex:)``, and makes a protected call for every level. A `LuaPath`
+/// converts its keys once when it is created, and can then be used with ``LuaValue/get(_:as:)`` (or the `LuaPath`
+/// overloads of `LuaValue.get(_:)` and subscript) to perform the whole lookup in one go, creating at most one
+/// `LuaValue`:
+///
+/// ```swift
+/// let rpsPath = LuaPath("config", "limits", "rps")
+/// // ...
+/// let rps = try L.globals.get(rpsPath, as: Int.self)
+/// ```
+///
+/// Levels which are tables without a metatable are indexed directly, without making a protected call. Any remaining
+/// levels are indexed (invoking metamethods as necessary) within a single protected call.
+///
+/// A `LuaPath` does not refer to any particular `LuaState`, so it can be created once (for example in a `static let`)
+/// and used with any number of states.
+public struct LuaPath {
+    /// A single key in a `LuaPath`, either a string or an integer.
+    ///
+    /// Keys can be written as string or integer literals, so paths can usually be constructed without mentioning this
+    /// type, for example `LuaPath("config", "list", 2)`. Use `LuaPath.Key(someString)` or `LuaPath.Key(someInt)` to
+    /// construct a key from a variable.
+    public struct Key: ExpressibleByStringLiteral, ExpressibleByIntegerLiteral {
+        internal enum Value {
+            case string([CChar])
+            case integer(lua_Integer)
+        }
+
+        internal let value: Value
+
+        /// Create a string key. The string is converted to a Lua string using UTF-8.
+        public init(_ string: String) {
+            value = .string(string.utf8.map { CChar(bitPattern: $0) })
+        }
+
+        /// Create an integer key.
+        public init(_ int: Int) {
+            value = .integer(lua_Integer(int))
+        }
+
+        /// Create an integer key.
+        public init(_ int: lua_Integer) {
+            value = .integer(int)
+        }
+
+        public init(stringLiteral value: String) {
+            self.init(value)
+        }
+
+        public init(integerLiteral value: Int) {
+            self.init(value)
+        }
+
+        internal func push(onto L: LuaState) {
+            switch value {
+            case .string(let str):
+                str.withUnsafeBufferPointer { buf in
+                    lua_pushlstring(L, buf.baseAddress, buf.count)
+                }
+            case .integer(let int):
+                lua_pushinteger(L, int)
+            }
+        }
+    }
+
+    internal let keys: [Key]
+
+    /// Create a path from a list of keys.
+    ///
+    /// - Parameter keys: The keys to look up, in order.
+    public init(_ keys: Key...) {
+        self.init(keys: keys)
+    }
+
+    /// Create a path from an array of keys.
+    ///
+    /// - Parameter keys: The keys to look up, in order.
+    public init(keys: [Key]) {
+        self.keys = keys
+    }
+}
+
+extension UnsafeMutablePointer where Pointee == lua_State {
+    // Replaces the value on the top of the stack with the result of looking up path in it. On error, pops the value.
+    internal func walk(_ path: LuaPath) throws {
+        let keys = path.keys
+        var i = 0
+        // No metamethods can run, so nothing can error
+        while i < keys.count && isPlainTable(-1) {
+            keys[i].push(onto: self)
+            lua_rawget(self, -2)
+            lua_remove(self, -2)
+            i += 1
+        }
+        if i == keys.count {
+            return
+        } else if isnil(-1) {
+            pop()
+            throw LuaValueError.nilValue
+        }
+
+        checkstack(CInt(keys.count - i) + 2)
+        push(function: luaswift_getpath, toindex: -2)
+        for key in keys[i...] {
+            key.push(onto: self)
+        }
+        try pcall(nargs: CInt(keys.count - i) + 1, nret: 2, traceback: false)
+        let status = lua_tointegerx(self, -1, nil)
+        pop()
+        switch status {
+        case lua_Integer(LUASWIFT_PATH_NIL):
+            pop()
+            throw LuaValueError.nilValue
+        case lua_Integer(LUASWIFT_PATH_NOTINDEXABLE):
+            pop()
+            throw LuaValueError.notIndexable
+        default:
+            break
+        }
+    }
+}
+
+extension LuaValue {
+    /// Returns the value found by looking up each of the keys in `path` in turn, starting from this value.
+    ///
+    /// Equivalent to calling `get(_:)` once for each key in `path`, but more efficient. See ``LuaPath``.
+    ///
+    /// ```swift
+    /// let rps = try L.globals.get(LuaPath("config", "limits", "rps"))
+    /// ```
+    ///
+    /// - Parameter path: The keys to look up.
+    /// - Returns: The resulting value as a `LuaValue`.
+    /// - Throws: ``LuaValueError/nilValue`` if the Lua value associated with `self`, or any intermediate value, is
+    ///           `nil`.
+    ///           ``LuaValueError/notIndexable`` if the Lua value or any intermediate value does not support indexing.
+    ///           ``LuaCallError`` if an error is thrown during a metatable `__index` call.
+    public func get(_ path: LuaPath) throws -> LuaValue {
+        guard valid() else {
+            throw LuaValueError.nilValue
+        }
+        push(onto: L)
+        try L.walk(path)
+        return L.popref()
+    }
+
+    /// Returns the value found by looking up each of the keys in `path` in turn, converted to type `T`.
+    ///
+    /// This is equivalent to `get(path).tovalue()`, except that it does not create a `LuaValue` for the result.
+    ///
+    /// - Parameter path: The keys to look up.
+    /// - Parameter type: The type to convert the result to, using the same rules as
+    ///   ``Lua/Swift/UnsafeMutablePointer/tovalue(_:)``.
+    /// - Returns: The resulting value, or `nil` if it could not be converted to `T`.
+    /// - Throws: The same errors as `get(_:)`.
+    public func get<T>(_ path: LuaPath, as type: T.Type) throws -> T? {
+        guard valid() else {
+            throw LuaValueError.nilValue
+        }
+        push(onto: L)
+        try L.walk(path)
+        defer {
+            L.pop()
+        }
+        if let result: T = L.checkArgumentFastPath(-1) {
+            return result
+        }
+        return L.tovalue(-1)
+    }
+
+    /// Non-throwing convenience function, otherwise identical to `get(_ path: LuaPath)`.
+    ///
+    /// If any error is thrown by the underlying `get()` call, the error is silently ignored and a `LuaValue`
+    /// representing `nil` is returned instead.
+    ///
+    /// ```swift
+    /// let rps = L.globals[LuaPath("config", "limits", "rps")]
+    /// ```
+    public subscript(path: LuaPath) -> LuaValue {
+        return (try? get(path)) ?? LuaValue.nilValue
+    }
+}
@@ -0,0 +1,279 @@
+// Copyright (c) 2023 Tom Sutcliffe
+// See LICENSE file for license information.
+
+import CLua
+
+/// A concrete Swift representation of a Lua value made up only of plain data.
+///
+/// `LuaPlainValue` can represent any Lua value composed of `nil`, booleans, numbers, strings and tables (whose keys
+/// and values are themselves representable). Unlike ``Lua/Swift/UnsafeMutablePointer/toany(_:guessType:)`` it does not
+/// require boxing every value in an `Any` or `AnyHashable` existential, nor any dynamic casts to get the values back
+/// out, which makes it well suited for passing JSON-like data between Swift and Lua.
+///
+/// Use ``Lua/Swift/UnsafeMutablePointer/toplainvalue(_:)`` to convert a Lua value to a `LuaPlainValue`. `LuaPlainValue`
+/// is `Pushable`, so to convert back to Lua use ``Lua/Swift/UnsafeMutablePointer/push(_:toindex:)``.
+public enum LuaPlainValue: Hashable {
+    case `nil`
+    case bool(Bool)
+    case int(lua_Integer)
+    case double(lua_Number)
+    /// A Lua string which is valid UTF-8.
+    case string(String)
+    /// A Lua string which is not valid UTF-8.
+    case bytes([UInt8])
+    /// A table whose keys are exactly the integers `1...count`.
+    case array([LuaPlainValue])
+    /// Any other table.
+    case map([LuaPlainValue: LuaPlainValue])
+}
+
+extension LuaPlainValue: Pushable {
+    /// Push this value on to the stack.
+    ///
+    /// Strings are pushed as UTF-8, regardless of the default string encoding. `.array` and `.map` are pushed as new
+    /// tables, without metatables. Any `.map` entries with a `.nil` or NaN key are skipped, because Lua tables cannot
+    /// contain such keys.
+    public func push(onto L: LuaState) {
+        switch self {
+        case .nil:
+            lua_pushnil(L)
+        case .bool(let val):
+            lua_pushboolean(L, val ? 1 : 0)
+        case .int(let val):
+            lua_pushinteger(L, val)
+        case .double(let val):
+            lua_pushnumber(L, val)
+        case .string(var val):
+            val.withUTF8 { buf in
+                lua_pushlstring(L, UnsafeRawPointer(buf.baseAddress)?.assumingMemoryBound(to: CChar.self), buf.count)
+            }
+        case .bytes(let val):
+            L.push(val)
+        case .array(let val):
+            L.checkstack(2)
+            lua_createtable(L, CInt(clamping: val.count), 0)
+            for (i, element) in val.enumerated() {
+                element.push(onto: L)
+                lua_rawseti(L, -2, lua_Integer(i + 1))
+            }
+        case .map(let val):
+            L.checkstack(3)
+            lua_createtable(L, 0, CInt(clamping: val.count))
+            for (k, v) in val {
+                switch k {
+                case .nil:
+                    continue
+                case .double(let d) where d.isNaN:
+                    continue
+                default:
+                    k.push(onto: L)
+                    v.push(onto: L)
+                    lua_rawset(L, -3)
+                }
+            }
+        }
+    }
+}
+
+extension LuaPlainValue: Codable {
+    private struct Key: CodingKey {
+        var stringValue: String
+        var intValue: Int?
+
+        init(stringValue: String) {
+            self.stringValue = stringValue
+            self.intValue = nil
+        }
+
+        init(intValue: Int) {
+            self.stringValue = "\(intValue)"
+            self.intValue = intValue
+        }
+    }
+
+    /// Decode a `LuaPlainValue`.
+    ///
+    /// Keyed containers are always decoded as `.map` with `.string` keys, and unkeyed containers as `.array`.
+    public init(from decoder: Decoder) throws {
+        let container = try decoder.singleValueContainer()
+        if container.decodeNil() {
+            self = .nil
+        } else if let val = try? container.decode(Bool.self) {
+            self = .bool(val)
+        } else if let val = try? container.decode(lua_Integer.self) {
+            self = .int(val)
+        } else if let val = try? container.decode(lua_Number.self) {
+            self = .double(val)
+        } else if let val = try? container.decode(String.self) {
+            self = .string(val)
+        } else if let val = try? container.decode([LuaPlainValue].self) {
+            self = .array(val)
+        } else if let val = try? container.decode([String: LuaPlainValue].self) {
+            var map: [LuaPlainValue: LuaPlainValue] = [:]
+            map.reserveCapacity(val.count)
+            for (k, v) in val {
+                map[.string(k)] = v
+            }
+            self = .map(map)
+        } else {
+            throw DecodingError.dataCorruptedError(in: container, debugDescription: "Value cannot be represented as a LuaPlainValue")
+        }
+    }
+
+    /// Encode a `LuaPlainValue`.
+    ///
+    /// `.bytes` is encoded as an array of integers. `.map` is encoded as a keyed container, and can only be encoded if
+    /// all its keys are `.string` or `.int` (how integer keys are represented is up to the encoder, but for example
+    /// `JSONEncoder` will convert them to strings).
+    ///
+    /// - Throws: `EncodingError.invalidValue` if a `.map` contains a key which is not a `.string` or `.int`.
+    public func encode(to encoder: Encoder) throws {
+        switch self {
+        case .map(let val):
+            var container = encoder.container(keyedBy: Key.self)
+            for (k, v) in val {
+                switch k {
+                case .string(let str):
+                    try container.encode(v, forKey: Key(stringValue: str))
+                case .int(let int) where Int(exactly: int) != nil:
+                    try container.encode(v, forKey: Key(intValue: Int(int)))
+                default:
+                    let context = EncodingError.Context(codingPath: container.codingPath,
+                        debugDescription: "Only string and integer map keys can be encoded")
+                    throw EncodingError.invalidValue(self, context)
+                }
+            }
+        default:
+            var container = encoder.singleValueContainer()
+            switch self {
+            case .nil: try container.encodeNil()
+            case .bool(let val): try container.encode(val)
+            case .int(let val): try container.encode(val)
+            case .double(let val): try container.encode(val)
+            case .string(let val): try container.encode(val)
+            case .bytes(let val): try container.encode(val)
+            case .array(let val): try container.encode(val)
+            case .map: fatalError() // Handled above
+            }
+        }
+    }
+}
+
+extension UnsafeMutablePointer where Pointee == lua_State {
+
+    /// Convert a value on the stack to a ``LuaPlainValue``.
+    ///
+    /// Strings which are valid UTF-8 are converted to `.string` (regardless of the default string encoding), other
+    /// strings are converted to `.bytes`. A table is converted to `.array` if its keys are exactly the integers
+    /// `1...n` (including an empty table), and to `.map` otherwise. Tables are accessed using raw accesses, so no
+    /// metamethods are invoked and any metatables are ignored.
+    ///
+    /// - Parameter index: The stack index of the value.
+    /// - Returns: The converted value, or `nil` if the value, or any value reachable from it, is not a `nil`, boolean,
+    ///   number, string or table, or if it contains a reference cycle.
+    public func toplainvalue(_ index: CInt) -> LuaPlainValue? {
+        var visiting = Set<UnsafeRawPointer>()
+        return toplainvalue(index, visiting: &visiting)
+    }
+
+    private func toplainvalue(_ index: CInt, visiting: inout Set<UnsafeRawPointer>) -> LuaPlainValue? {
+        switch lua_type(self, index) {
+        case LUA_TNIL, LUA_TNONE:
+            return .nil
+        case LUA_TBOOLEAN:
+            return .bool(lua_toboolean(self, index) != 0)
+        case LUA_TNUMBER:
+            if lua_isinteger(self, index) != 0 {
+                return .int(lua_tointegerx(self, index, nil))
+            } else {
+                return .double(lua_tonumberx(self, index, nil))
+            }
+        case LUA_TSTRING:
+            var len: Int = 0
+            let ptr = lua_tolstring(self, index, &len)!
+            // Lua strings are always null terminated, so validatingUTF8 is safe providing we check for embedded nulls
+            if let str = String(validatingUTF8: ptr), str.utf8.count == len {
+                return .string(str)
+            } else {
+                return .bytes(Array(UnsafeRawBufferPointer(start: ptr, count: len)))
+            }
+        case LUA_TTABLE:
+            let tablePtr = lua_topointer(self, index)!
+            guard visiting.insert(tablePtr).inserted else {
+                return nil
+            }
+            defer {
+                visiting.remove(tablePtr)
+            }
+            return tableToPlainValue(absindex(index), visiting: &visiting)
+        default:
+            return nil
+        }
+    }
+
+    private func tableToPlainValue(_ index: CInt, visiting: inout Set<UnsafeRawPointer>) -> LuaPlainValue? {
+        checkstack(3)
+        let top = gettop()
+        defer {
+            settop(top)
+        }
+        let n = Int(lua_rawlen(self, index))
+        var count = 0
+        lua_pushnil(self)
+        while lua_next(self, index) != 0 {
+            count = count + 1
+            pop()
+        }
+
+        if count == n {
+            var array: [LuaPlainValue] = []
+            array.reserveCapacity(count)
+            var isArray = true
+            for i in 0 ..< count {
+                if lua_rawgeti(self, index, lua_Integer(i + 1)) == LUA_TNIL {
+                    // Not a proper sequence after all
+                    isArray = false
+                    break
+                }
+                guard let element = toplainvalue(-1, visiting: &visiting) else {
+                    return nil
+                }
+                array.append(element)
+                pop()
+            }
+            if isArray {
+                return .array(array)
+            }
+            settop(top)
+        }
+
+        var map: [LuaPlainValue: LuaPlainValue] = [:]
+        map.reserveCapacity(count)
+        lua_pushnil(self)
+        while lua_next(self, index) != 0 {
+            guard let k = toplainvalue(-2, visiting: &visiting), let v = toplainvalue(-1, visiting: &visiting) else {
+                return nil
+            }
+            map[k] = v
+            pop()
+        }
+        return .map(map)
+    }
+}
+
+extension LuaValue {
+    /// Convert this value to a ``LuaPlainValue``.
+    ///
+    /// See ``Lua/Swift/UnsafeMutablePointer/toplainvalue(_:)``.
+    ///
+    /// - Returns: The converted value, or `nil` if it cannot be represented as a `LuaPlainValue`.
+    public func toplainvalue() -> LuaPlainValue? {
+        if type == .nil {
+            return .nil
+        }
+        push(onto: L)
+        let result = L.toplainvalue(-1)
+        L.pop()
+        return result
+    }
+}
@@ -64,7 +64,16 @@ public let LUA_VERSION = LuaVer(major: LUASWIFT_LUA_VERSION_MAJOR, minor: LUASWI
 
 @usableFromInline
 internal func defaultTracebackFn(_ L: LuaState!) -> CInt {
-    if let msg = L.tostring(-1) {
+    // A lazy traceback is only any use if there's a protected call waiting to claim it (see beginTracebackCapture());
+    // a raw lua_pcall() using a resident handler gets a normal traceback.
+    if let state = L.extraSpaceState(), state.lazyTraceback, state.tracebackCaptureDepth > 0 {
+        let t = lua_type(L, -1)
+        if t == LUA_TSTRING || t == LUA_TNUMBER {
+            // Leave the error message as-is, and stash the frames for the protected call to pick up.
+            lua_tolstring(L, -1, nil)
+            state.pendingTracebacks.append(LuaTraceback(L, level: 0))
+        }
+    } else if let msg = L.tostring(-1) {
         luaL_traceback(L, L, msg, 0)
     } else {
         // Just return the error object as-is
@@ -72,6 +81,41 @@ internal func defaultTracebackFn(_ L: LuaState!) -> CInt {
     return 1
 }
 
+// The upvalue of the closure pushed by pushResidentMessageHandler(). It is collected along with the closure, which
+// happens once the closure is popped or its thread is collected, at which point it removes the thread's entry from
+// residentMessageHandlers (unless the entry has since been replaced). The entry identifies it by ObjectIdentifier
+// rather than holding a reference, so as not to keep it alive.
+internal final class ResidentMessageHandler {
+    let thread: LuaState
+    weak var state: LuaState._State?
+
+    init(thread: LuaState, state: LuaState._State) {
+        self.thread = thread
+        self.state = state
+    }
+
+    deinit {
+        if let state, state.residentMessageHandlers[thread]?.handler == ObjectIdentifier(self) {
+            state.residentMessageHandlers[thread] = nil
+        }
+    }
+}
+
+fileprivate let callProtectedImpl: luaswift_ProtectedFn = { L, ctx in
+    let body = ctx.unsafelyUnwrapped.assumingMemoryBound(to: LuaClosure.self).pointee
+    do {
+        return try body(L.unsafelyUnwrapped)
+    } catch {
+        L.unsafelyUnwrapped.push(error: error)
+        return LUASWIFT_CALLCLOSURE_ERROR
+    }
+}
+
+// luaswift_callprotected calls callProtectedImpl via a static function pointer, which only needs setting once.
+fileprivate let callProtectedRegistered: Void = {
+    luaswift_setcallprotectedimpl(callProtectedImpl)
+}()
+
 // Because getting a raw pointer to a var to use with lua_rawsetp(L, LUA_REGISTRYINDEX) is so awkward in Swift, we use a
 // function instead as the registry key we stash the State in, because we _can_ reliably generate file-unique
 // lua_CFunctions.
@@ -503,18 +547,160 @@ extension UnsafeMutablePointer where Pointee == lua_State {
         }
     }
 
+    /// Configure whether Swift values are released by the garbage collector, or queued to be released later.
+    ///
+    /// By default, when a userdata created by ``push(userdata:toindex:)`` is garbage collected, the Swift value it
+    /// contains is released immediately, from within the garbage collector. If releasing the value is expensive (for
+    /// example because its `deinit` closes a file, or because it is the last reference to a large object graph) this
+    /// lengthens the garbage collection pause. When `deferred` is true, the collector instead moves each value into a
+    /// queue, and the values are released when ``releaseDeferredValues(limit:)`` is called, or handed back to the
+    /// caller by ``takeDeferredValues()``.
+    ///
+    /// Any values still queued when the state is closed are released during the call to ``close()``. Setting
+    /// `deferred` to false does not release values which have already been queued.
+    ///
+    /// - Parameter deferred: Whether to queue values released by the garbage collector.
+    public func setDeferredFinalization(_ deferred: Bool) {
+        getState().deferredFinalization = deferred
+    }
+
+    /// Release values queued by the garbage collector.
+    ///
+    /// See ``setDeferredFinalization(_:)``. The values which were queued first are released first. Must not be called
+    /// from within a finalizer.
+    ///
+    /// - Parameter limit: The maximum number of values to release, so that the work can be spread out in batches.
+    /// - Returns: The number of values which remain queued.
+    @discardableResult
+    public func releaseDeferredValues(limit: Int = .max) -> Int {
+        guard let state = maybeGetState() else {
+            return 0
+        }
+        // Values must not be released until they are no longer in deferredValues, in case a deinit causes a
+        // garbage collection step which appends to it.
+        let head = state.deferredValuesHead
+        let count = min(limit, state.deferredValues.count - head)
+        var batch: [Any?] = []
+        batch.reserveCapacity(count)
+        for i in head ..< head + count {
+            batch.append(state.deferredValues[i])
+            state.deferredValues[i] = nil
+        }
+        state.deferredValuesHead = head + count
+        // Shuffle the remaining values down only once at least half the array is released slots, so that releasing
+        // in small batches doesn't cost O(n) per call
+        if state.deferredValuesHead == state.deferredValues.count {
+            state.deferredValues.removeAll(keepingCapacity: true)
+            state.deferredValuesHead = 0
+        } else if state.deferredValuesHead >= state.deferredValues.count / 2 {
+            state.deferredValues.removeFirst(state.deferredValuesHead)
+            state.deferredValuesHead = 0
+        }
+        batch.removeAll()
+        return state.deferredValues.count - state.deferredValuesHead
+    }
+
+    /// Remove all the values queued by the garbage collector, without releasing them.
+    ///
+    /// See ``setDeferredFinalization(_:)``. This allows the values to be released elsewhere, for example on a
+    /// background thread if they are of types which are safe to release on other threads. Values which refer to the
+    /// `LuaState` (such as ``LuaValue``) must not be released on any thread other than the one using the state.
+    ///
+    /// - Returns: The values which were queued, in the order they were collected.
+    public func takeDeferredValues() -> [Any] {
+        guard let state = maybeGetState() else {
+            return []
+        }
+        let result = state.deferredValues[state.deferredValuesHead...].map { $0! }
+        state.deferredValues = []
+        state.deferredValuesHead = 0
+        return result
+    }
+
     class _State {
+        // Cached so that getMainThread() doesn't need to look it up in the registry
+        let mainThread: LuaState
 #if !LUASWIFT_NO_FOUNDATION
         var defaultStringEncoding: LuaStringEncoding = .stringEncoding(.utf8)
 #endif
         var metatableDict = Dictionary<String, Array<Any.Type>>()
-        var userdataMetatables = Set<UnsafeRawPointer>()
-        var luaValues = Dictionary<CInt, UnownedLuaValue>()
+        // Registry refs of the metatable to use for each type, see pushMetatable(for:state:)
+        var metatableRefs = Dictionary<ObjectIdentifier, CInt>()
+        // Registry refs of the weak-valued tables used by types which have called enableIdentityMap()
+        var identityMaps = Dictionary<ObjectIdentifier, CInt>()
+        // Metatables from register(_:lazily:) which will be registered the first time they are needed
+        var lazyMetatables = Dictionary<ObjectIdentifier, MetatableBlueprint.Entry>()
+        // Every userdata created by pushuserdata() starts with a UserdataHeader containing this value, which is how
+        // touserdata() distinguishes them from userdata created by other means.
+        let userdataMagic = UInt.random(in: 1 ... UInt.max)
+        // The type table, indexed by UserdataHeader.typeId
+        var userdataTypes: [UserdataType] = []
+        var userdataTypeIds = Dictionary<ObjectIdentifier, Int>()
+        var luaValues = LuaValueTable()
+        var decoderKeyPlans = Dictionary<ObjectIdentifier, LuaDecoder.KeyPlan>()
+        var lazyTraceback = false
+        // The handler pushed by pushResidentMessageHandler(), per thread
+        var residentMessageHandlers = Dictionary<LuaState, (index: CInt, handler: ObjectIdentifier)>()
+        // Tracebacks captured by defaultTracebackFn which have not yet been claimed by the protected call that
+        // installed it, see beginTracebackCapture(). More than one can be pending because a to-be-closed variable can
+        // make (and fail) another pcall while the original error is still unwinding.
+        var pendingTracebacks: [LuaTraceback] = []
+        // The number of protected calls between beginTracebackCapture() and endTracebackCapture()
+        var tracebackCaptureDepth = 0
+
+        // Lazy tracebacks are captured by defaultTracebackFn where it cannot hand them to anyone, so a lua_pcall()
+        // which uses it as the message handler while lazyTraceback is set must be bracketed by these two calls, which
+        // return whatever was captured in between (normally nothing if the call succeeded, or one traceback if it
+        // failed). Captures are only made while there is a bracketed call in progress, so nothing can be left over.
+        func beginTracebackCapture() -> Int {
+            tracebackCaptureDepth += 1
+            return pendingTracebacks.count
+        }
+
+        func endTracebackCapture(_ mark: Int) -> ArraySlice<LuaTraceback> {
+            tracebackCaptureDepth -= 1
+            guard pendingTracebacks.count > mark else {
+                return []
+            }
+            let result = pendingTracebacks[mark...]
+            pendingTracebacks.removeSubrange(mark...)
+            return result
+        }
+        var deferredFinalization = false
+        // Values moved out of userdata finalized while deferredFinalization was set, see releaseDeferredValues()
+        var deferredValues: [Any?] = []
+        // deferredValues[..<deferredValuesHead] have already been released, and are nil
+        var deferredValuesHead = 0
+        // Bytes passed to reportExternalMemory() which have not yet been fed to the collector
+        var externalMemoryDebt = 0
 
-        deinit {
-            for (_, val) in luaValues {
-                val.val.L = nil
+        init(mainThread: LuaState) {
+            self.mainThread = mainThread
+        }
+
+        func decoderKeyPlan(for type: CodingKey.Type, _ L: LuaState) -> LuaDecoder.KeyPlan {
+            let id = ObjectIdentifier(type)
+            if let plan = decoderKeyPlans[id] {
+                return plan
+            }
+            let plan = LuaDecoder.KeyPlan(L)
+            decoderKeyPlans[id] = plan
+            return plan
+        }
+
+        func userdataTypeId<T>(for type: T.Type) -> Int {
+            let id = ObjectIdentifier(type)
+            if let typeId = userdataTypeIds[id] {
+                return typeId
             }
+            let typeId = userdataTypes.count
+            userdataTypes.append(UserdataType(type))
+            userdataTypeIds[id] = typeId
+            return typeId
+        }
+
+        deinit {
+            luaValues.invalidateAll()
         }
     }
 
@@ -522,18 +708,40 @@ extension UnsafeMutablePointer where Pointee == lua_State {
         if let state = maybeGetState() {
             return state
         }
-        let state = _State()
+        let state = _State(mainThread: getMainThread())
         // Register a metatable for this type with a fixed name to avoid infinite recursion of makeMetatableName
         // trying to call getState()
         let mtName = "LuaSwift_State"
         doRegisterMetatable(typeName: mtName)
-        // Note, the _State metatable doesn't need to go in userdataMetatables since maybeGetState() uses
-        // unchecked_touserdata() which doesn't consult userdataMetatables.
+        push(function: { L in
+            // Nothing finalized after this point must find the _State via the extra space, because it is about to
+            // be released. Finalizers always run on the main thread.
+            if let state = L.maybeGetState() {
+                // Otherwise the state would be moved into its own deferredValues
+                state.deferredFinalization = false
+            }
+            if let extraspace = luaswift_getextraspace(L.getMainThread()) {
+                extraspace.pointee = nil
+            }
+            L.deinitUserdata(1, finalize: true)
+            return 0
+        })
+        rawset(-2, utf8Key: "__gc") // Replaces the default one
         pop() // metatable
         push(function: stateLookupKey)
-        pushuserdata(state, metatableName: mtName)
+        pushuserdata(state, metatableName: mtName, state: state)
         rawset(LUA_REGISTRYINDEX)
 
+        // The registry entry keeps state alive (until the state is closed), the extra space pointer is just a faster
+        // way of getting to it. Coroutines created from now on inherit the main thread's extra space.
+        let statePtr = Unmanaged.passUnretained(state).toOpaque()
+        if let extraspace = luaswift_getextraspace(getMainThread()) {
+            extraspace.pointee = statePtr
+        }
+        if let extraspace = luaswift_getextraspace(self) {
+            extraspace.pointee = statePtr
+        }
+
         // While we're here, register ClosureWrapper
         // Are we doing too much non-deferred initialization in getState() now?
         register(Metatable(for: LuaClosureWrapper.self))
@@ -541,15 +749,132 @@ extension UnsafeMutablePointer where Pointee == lua_State {
         return state
     }
 
+    // Like maybeGetState(), but never falls back to the registry (which means pushing and popping) if the extra space
+    // is empty, as it is on a coroutine created before the state was. For checks made on every protected call, which
+    // must treat such a coroutine as having no state, unless setExtraSpaceState() has been called on it. Only Lua
+    // versions without a usable extra space fall back to the registry.
+    func extraSpaceState() -> _State? {
+        guard let extraspace = luaswift_getextraspace(self) else {
+            return maybeGetState()
+        }
+        guard let statePtr = extraspace.pointee else {
+            return nil
+        }
+        return Unmanaged<_State>.fromOpaque(statePtr).takeUnretainedValue()
+    }
+
+    // Makes extraSpaceState() work on this thread, which might be a coroutine created before the state was.
+    func setExtraSpaceState(_ state: _State) {
+        if let extraspace = luaswift_getextraspace(self), extraspace.pointee == nil {
+            extraspace.pointee = Unmanaged.passUnretained(state).toOpaque()
+        }
+    }
+
     func maybeGetState() -> _State? {
+        if let extraspace = luaswift_getextraspace(self), let statePtr = extraspace.pointee {
+            return Unmanaged<_State>.fromOpaque(statePtr).takeUnretainedValue()
+        }
+        return maybeGetStateFromRegistry()
+    }
+
+    // Only needed when there is no extra space, or for threads which were created before the _State was.
+    private func maybeGetStateFromRegistry() -> _State? {
         push(function: stateLookupKey)
         rawget(LUA_REGISTRYINDEX)
         defer {
             pop()
         }
-        // We must call the unchecked version to avoid recursive loops as touserdata calls maybeGetState(). This is
-        // safe because we know the value of StateRegistryKey does not need checking.
-        return unchecked_touserdata(-1)
+        // We can't call touserdata() here because it calls maybeGetState(). This is safe because we know the value
+        // of StateRegistryKey is a userdata containing a _State, unless it has already been finalized in which case
+        // its header will have been invalidated.
+        guard let udata = lua_touserdata(self, -1),
+              udata.load(as: UserdataHeader.self).magic != 0 else {
+            return nil
+        }
+        return (udata + Self.UserdataHeaderSize).assumingMemoryBound(to: _State.self).pointee
+    }
+
+    // MARK: - Userdata internals
+
+    // Every userdata created by pushuserdata() has this header, followed by the value itself. The value is stored
+    // directly as its static type (rather than being boxed in an `Any`) unless its alignment is greater than Lua
+    // guarantees for userdata memory.
+    struct UserdataHeader {
+        // Either the state's userdataMagic, or zero once the value has been finalized.
+        var magic: UInt
+        // Index into the state's userdataTypes, or ClosedUserdataTypeId once the value has been deinited by a close.
+        var typeId: Int
+    }
+
+    static var UserdataHeaderSize: Int { MemoryLayout<UserdataHeader>.stride }
+    static var ClosedUserdataTypeId: Int { -1 }
+    // The minimum alignment of userdata memory (LUAI_MAXALIGN) is only guaranteed to be that of lua_Number, void*
+    // and lua_Integer.
+    static var UserdataMaxAlignment: Int { MemoryLayout<lua_Integer>.alignment }
+
+    // An entry in the per-state userdata type table.
+    struct UserdataType {
+        let type: Any.Type
+        let load: (UnsafeMutableRawPointer) -> Any
+        let deinitialize: (UnsafeMutableRawPointer) -> Void
+        let move: (UnsafeMutableRawPointer) -> Any
+        // Whether values of this type might conform to LuaMemoryReporting, which for Any depends on the dynamic type
+        let mayReportMemory: Bool
+
+        init<T>(_ type: T.Type) {
+            self.type = type
+            self.mayReportMemory = type is LuaMemoryReporting.Type || type == Any.self
+            self.load = { $0.assumingMemoryBound(to: T.self).pointee }
+            self.deinitialize = { $0.assumingMemoryBound(to: T.self).deinitialize(count: 1) }
+            self.move = { $0.assumingMemoryBound(to: T.self).move() }
+        }
+    }
+
+    // Returns a pointer to the value of the LuaSwift userdata at index, and its type table entry. Returns nil if the
+    // value is not a userdata created by pushuserdata() in this state, or if it has been closed.
+    internal func userdataValue(_ index: CInt) -> (UnsafeMutableRawPointer, UserdataType)? {
+        guard lua_type(self, index) == LUA_TUSERDATA,
+              Int(lua_rawlen(self, index)) >= Self.UserdataHeaderSize,
+              let udata = lua_touserdata(self, index),
+              let state = maybeGetState() else {
+            return nil
+        }
+        let header = udata.load(as: UserdataHeader.self)
+        guard header.magic == state.userdataMagic,
+              header.typeId >= 0 && header.typeId < state.userdataTypes.count else {
+            return nil
+        }
+        return (udata + Self.UserdataHeaderSize, state.userdataTypes[header.typeId])
+    }
+
+    // Deinits the value of the LuaSwift userdata at index, if it is one and has not already been closed. If
+    // `finalize` is false (ie when called from a close metamethod) the userdata is marked as closed, otherwise (ie
+    // from __gc) the header is invalidated so the memory can never be mistaken for a LuaSwift userdata should it be
+    // reused for a userdata created by other means.
+    internal func deinitUserdata(_ index: CInt, finalize: Bool) {
+        guard lua_type(self, index) == LUA_TUSERDATA,
+              Int(lua_rawlen(self, index)) >= Self.UserdataHeaderSize,
+              let udata = lua_touserdata(self, index),
+              let state = maybeGetState() else {
+            return
+        }
+        var header = udata.load(as: UserdataHeader.self)
+        guard header.magic == state.userdataMagic else {
+            return
+        }
+        if header.typeId >= 0 && header.typeId < state.userdataTypes.count {
+            let udType = state.userdataTypes[header.typeId]
+            if finalize && state.deferredFinalization {
+                state.deferredValues.append(udType.move(udata + Self.UserdataHeaderSize))
+            } else {
+                udType.deinitialize(udata + Self.UserdataHeaderSize)
+            }
+        }
+        if finalize {
+            header.magic = 0
+        }
+        header.typeId = Self.ClosedUserdataTypeId
+        udata.storeBytes(of: header, as: UserdataHeader.self)
     }
 
     // MARK: - Basic stack stuff
@@ -1023,32 +1348,17 @@ extension UnsafeMutablePointer where Pointee == lua_State {
     /// - Returns: A value of type `T`, or `nil` if the value at the given stack position is not a `userdata` created
     ///   with `push(userdata:)` or it cannot be cast to `T`.
     public func touserdata<T>(_ index: CInt) -> T? {
-        // We don't need to check the metatable name with eg luaL_testudata because we store everything as Any
-        // so the final as? check takes care of that. But we should check that the userdata has a metatable we
-        // know about, to verify that it is safely convertible to an Any, and not an unrelated userdata some caller has
-        // created directly with lua_newuserdatauv().
-        guard lua_getmetatable(self, index) == 1 else {
-            // userdata without a metatable can't be one of ours
-            return nil
-        }
-        let mtPtr = lua_topointer(self, -1)
-        pop() // metatable
-        guard let mtPtr,
-              let state = maybeGetState(),
-              state.userdataMetatables.contains(mtPtr) else {
-            // Not a userdata metatable we registered
+        // Every userdata created by push(userdata:) has a header identifying it (see userdataValue()) so there's no
+        // need to check the metatable, and if it was stored as exactly type T we can load it directly without having
+        // to go via Any.
+        guard let (valuePtr, udType) = userdataValue(index) else {
             return nil
         }
-
-        return unchecked_touserdata(index)
-    }
-
-    private func unchecked_touserdata<T>(_ index: CInt) -> T? {
-        guard let rawptr = lua_touserdata(self, index) else {
-            return nil
+        if udType.type == T.self {
+            return valuePtr.assumingMemoryBound(to: T.self).pointee
+        } else {
+            return udType.load(valuePtr) as? T
         }
-        let typedPtr = rawptr.bindMemory(to: Any.self, capacity: 1)
-        return typedPtr.pointee as? T
     }
 
     /// Convert a value on the stack to the specified `Decodable` type.
@@ -1233,33 +1543,23 @@ extension UnsafeMutablePointer where Pointee == lua_State {
     /// - Throws: ``LuaCallError`` if a Lua error is raised during the execution a `__index` metafield or if the value
     ///   does not support indexing.
     public func for_ipairs(_ index: CInt, start: lua_Integer = 1, _ block: (lua_Integer) throws -> Bool) throws {
-        try withoutActuallyEscaping(block) { escapingBlock in
-            let wrapper = LuaClosureWrapper({ L in
-                var i = start
-                while true {
-                    L.settop(1)
-                    let t = try L.get(1, key: i)
-                    if t == .nil {
-                        break
-                    }
-                    let shouldContinue = try escapingBlock(i)
-                    if !shouldContinue {
-                        break
-                    }
-                    i = i + 1
+        push(index: index) // Push first as could be relative index
+        try protectedCall(nargs: 1, nret: 0, traceback: false) { L in
+            // Even though we're in protected mode, an error must not be raised directly from here because it would
+            // longjmp over Swift frames, hence L.get() making a nested protected call.
+            var i = start
+            while true {
+                L.settop(1)
+                if try L.get(1, key: i) == .nil {
+                    break
                 }
-                return 0
-            })
-
-            // Must ensure closure does not actually escape, since we cannot rely on garbage collection of the upvalue
-            // of the closure, explicitly nil it in the ClosureWrapper instead
-            defer {
-                wrapper._closure = nil
+                let shouldContinue = try block(i)
+                if !shouldContinue {
+                    break
+                }
+                i = i + 1
             }
-
-            push(index: index) // Push first as could be relative index
-            push(wrapper, toindex: -2)
-            try pcall(nargs: 1, nret: 0, traceback: false)
+            return 0
         }
     }
 
@@ -1383,38 +1683,28 @@ extension UnsafeMutablePointer where Pointee == lua_State {
 
     // Top of stack must have iterfn, state, initval
     func do_for_pairs(_ block: (CInt, CInt) throws -> Bool) throws {
-        try withoutActuallyEscaping(block) { escapingBlock in
-            let wrapper = LuaClosureWrapper({ L in
-                // Stack: 1 = iterfn, 2 = state, 3 = initval (k)
-                while true {
-                    L.settop(3)
-                    L.push(index: 1)
-                    lua_insert(L, 3) // put iterfn before k
-                    L.push(index: 2)
-                    lua_insert(L, 4) // put state before k
-                    // 3, 4, 5 is now iterfn copy, state copy, k
-                    lua_call(L, 2, 2) // k, v = iterfn(state, k)
-                    // Stack is now 1 = iterfn, 2 = state, 3 = k, 4 = v
-                    if L.isnoneornil(3) {
-                        break
-                    }
-                    let shouldContinue = try escapingBlock(3, 4)
-                    if !shouldContinue {
-                        break
-                    }
-                    // new k is in position 3 ready to go round loop again
+        try protectedCall(nargs: 3, nret: 0, traceback: true) { L in
+            // Stack: 1 = iterfn, 2 = state, 3 = initval (k)
+            while true {
+                L.settop(3)
+                L.push(index: 1)
+                lua_insert(L, 3) // put iterfn before k
+                L.push(index: 2)
+                lua_insert(L, 4) // put state before k
+                // 3, 4, 5 is now iterfn copy, state copy, k
+                lua_call(L, 2, 2) // k, v = iterfn(state, k)
+                // Stack is now 1 = iterfn, 2 = state, 3 = k, 4 = v
+                if L.isnoneornil(3) {
+                    break
                 }
-                L.settop(0)
-                return 0
-            })
-
-            // Must ensure closure does not actually escape, since we cannot rely on prompt garbage collection of the
-            // upvalue, explicitly nil it in the ClosureWrapper instead.
-            defer {
-                wrapper._closure = nil
+                let shouldContinue = try block(3, 4)
+                if !shouldContinue {
+                    break
+                }
+                // new k is in position 3 ready to go round loop again
             }
-            push(wrapper, toindex: -4) // Push wrapper below iterfn, state, initval
-            try pcall(nargs: 3, nret: 0)
+            L.settop(0)
+            return 0
         }
     }
 
@@ -1732,20 +2022,106 @@ extension UnsafeMutablePointer where Pointee == lua_State {
     /// - Parameter userdata: The value to push on to the Lua stack.
     /// - Parameter toindex: See <doc:LuaState#Push-functions-toindex-parameter>.
     public func push<T>(userdata: T, toindex: CInt = -1) {
-        let anyval: Any = userdata
-        let tname = makeMetatableName(for: Swift.type(of: anyval))
-        pushuserdata(anyval, metatableName: tname)
+        pushuserdata(userdata)
         if toindex != -1 {
             insert(toindex)
         }
     }
 
-    private func pushuserdata(_ val: Any, metatableName: String) {
-        let udata = luaswift_newuserdata(self, MemoryLayout<Any>.size)!
-        let udataPtr = udata.bindMemory(to: Any.self, capacity: 1)
-        udataPtr.initialize(to: val)
+    internal func pushuserdata<T>(_ val: T) {
+        let state = getState()
+        let dynamicType = Swift.type(of: val as Any)
+        if !state.identityMaps.isEmpty, let identityMap = state.identityMaps[ObjectIdentifier(dynamicType)] {
+            pushuserdata(val, identityMap: identityMap, state: state)
+            return
+        }
+        let externalMemory = pushuserdataValue(val, state: state)
+        pushMetatable(for: dynamicType, state: state)
+        lua_setmetatable(self, -2) // pops metatable
+        if externalMemory > 0 {
+            reportExternalMemory(externalMemory, state: state)
+        }
+    }
+
+    // The identity map is keyed by the object's address. Because the userdata holds a strong reference to the
+    // object, the address cannot be reused while there is an entry for it. val is stored as T, the same as for any
+    // other push, so that touserdata() can still load it directly. val is only ever an instance of a class type passed
+    // to enableIdentityMap(), so the AnyObject cast does not box it.
+    private func pushuserdata<T>(_ val: T, identityMap: CInt, state: _State) {
+        checkstack(3)
+        let obj = val as AnyObject
+        let key = Unmanaged.passUnretained(obj).toOpaque()
+        lua_rawgeti(self, LUA_REGISTRYINDEX, lua_Integer(identityMap))
+        lua_pushlightuserdata(self, key)
+        if lua_rawget(self, -2) == LUA_TUSERDATA,
+           lua_touserdata(self, -1)!.load(as: UserdataHeader.self).typeId != Self.ClosedUserdataTypeId {
+            lua_remove(self, -2) // identityMap
+            return
+        }
+        pop()
+        let externalMemory = pushuserdataValue(val, state: state)
+        pushMetatable(for: Swift.type(of: obj), state: state)
+        lua_setmetatable(self, -2) // pops metatable
+        lua_pushlightuserdata(self, key)
+        push(index: -2)
+        lua_rawset(self, -4)
+        lua_remove(self, -2) // identityMap
+        if externalMemory > 0 {
+            reportExternalMemory(externalMemory, state: state)
+        }
+    }
+
+    private func pushuserdata<T>(_ val: T, metatableName: String, state: _State) {
+        let externalMemory = pushuserdataValue(val, state: state)
         pushmetatable(name: metatableName)
         lua_setmetatable(self, -2) // pops metatable
+        if externalMemory > 0 {
+            reportExternalMemory(externalMemory, state: state)
+        }
+    }
+
+    // Pushes a userdata containing val, without a metatable. Returns the amount of external memory val reports (see
+    // LuaMemoryReporting), which the caller must pass to reportExternalMemory() once the userdata is fully set up,
+    // because that can run the garbage collector, and thus arbitrary finalizers.
+    private func pushuserdataValue<T>(_ val: T, state: _State) -> Int {
+        if MemoryLayout<T>.alignment > Self.UserdataMaxAlignment {
+            return pushuserdataValue(val as Any, state: state)
+        }
+        let typeId = state.userdataTypeId(for: T.self)
+        let header = UserdataHeader(magic: state.userdataMagic, typeId: typeId)
+        let udata = luaswift_newuserdata(self, Self.UserdataHeaderSize + MemoryLayout<T>.size)!
+        udata.storeBytes(of: header, as: UserdataHeader.self)
+        (udata + Self.UserdataHeaderSize).initializeMemory(as: T.self, repeating: val, count: 1)
+        if state.userdataTypes[typeId].mayReportMemory, let reporting = val as? LuaMemoryReporting {
+            return reporting.luaExternalMemorySize
+        }
+        return 0
+    }
+
+    /// Make pushing the same instance of class `T` more than once reuse the same userdata.
+    ///
+    /// By default, every call to ``push(userdata:toindex:)`` creates a new Lua userdata, even if the value being pushed
+    /// is an object which has been pushed before. This means that the two userdata do not compare equal in Lua, and
+    /// that each push costs an allocation and an extra finalizer. After calling this function, pushing an instance of
+    /// `T` which is already referenced by a userdata that has not been garbage collected pushes that existing userdata
+    /// instead. The cache uses a weak-valued table, so it does not extend the lifetime of any userdata.
+    ///
+    /// Only instances whose dynamic type is exactly `T` are affected - subclasses of `T` must be enabled separately.
+    /// If the cached userdata has been closed (see ``Metatable/CloseType``), a new userdata is created and cached.
+    /// Calling this function more than once for the same type has no further effect.
+    ///
+    /// - Parameter type: The class to enable the identity map for.
+    public func enableIdentityMap<T: AnyObject>(for type: T.Type) {
+        let state = getState()
+        let id = ObjectIdentifier(type)
+        if state.identityMaps[id] != nil {
+            return
+        }
+        newtable()
+        newtable(nrec: 1)
+        rawset(-1, utf8Key: "__mode", value: "v")
+        lua_setmetatable(self, -2)
+        state.identityMaps[id] = luaL_ref(self, LUA_REGISTRYINDEX)
     }
 
     /// Push the metatable for type `T` on to the stack.
@@ -1758,8 +2134,23 @@ extension UnsafeMutablePointer where Pointee == lua_State {
     /// occasionally be useful to modify the metatable after it has been created by `register(_:)`. For example, to
     /// add a `__metatable` field.
     public func pushMetatable<T>(for type: T.Type) {
-        let tname = makeMetatableName(for: type)
-        pushmetatable(name: tname)
+        pushMetatable(for: type, state: getState())
+    }
+
+    // Looking up the metatable by name means constructing and hashing the name (twice), so the result is cached in
+    // state.metatableRefs. Resolving to the default metatable is cached too, so register() must invalidate the entry.
+    private func pushMetatable(for type: Any.Type, state: _State) {
+        let id = ObjectIdentifier(type)
+        if let ref = state.metatableRefs[id] {
+            lua_rawgeti(self, LUA_REGISTRYINDEX, lua_Integer(ref))
+            return
+        }
+        if let entry = state.lazyMetatables.removeValue(forKey: id) {
+            register(entry)
+        }
+        pushmetatable(name: makeMetatableName(for: type))
+        push(index: -1)
+        state.metatableRefs[id] = luaL_ref(self, LUA_REGISTRYINDEX)
     }
 
     private func pushmetatable(name: String) {
@@ -1771,7 +2162,6 @@ extension UnsafeMutablePointer where Pointee == lua_State {
                 pop()
                 print("Implicitly registering empty metatable for type \(name)")
                 doRegisterMetatable(typeName: name)
-                getState().userdataMetatables.insert(lua_topointer(self, -1))
             }
         }
     }
@@ -2007,9 +2397,39 @@ extension UnsafeMutablePointer where Pointee == lua_State {
     ///   full stack trace.
     /// - Throws: ``LuaCallError`` if a Lua error is raised during the execution of the function.
     /// - Precondition: The top of the stack must contain a function/callable and `nargs` arguments.
-    @inlinable
     public func pcall(nargs: CInt, nret: CInt, traceback: Bool = true) throws {
-        try pcall(nargs: nargs, nret: nret, msgh: traceback ? defaultTracebackFn : nil)
+        guard traceback else {
+            try pcall(nargs: nargs, nret: nret, msgh: nil)
+            return
+        }
+        if let index = residentMessageHandlerIndex(nargs: nargs) {
+            try pcall(nargs: nargs, nret: nret, tracebackIndex: index)
+        } else {
+            let index = gettop() - nargs
+            push(function: defaultTracebackFn, toindex: index)
+            defer {
+                // Keep the stack balanced
+                lua_remove(self, index)
+            }
+            try pcall(nargs: nargs, nret: nret, tracebackIndex: index)
+        }
+    }
+
+    // Calls lua_pcall() with defaultTracebackFn (which must already be at stack index msgh) as the message handler,
+    // attaching any lazy traceback it captures to the resulting error.
+    internal func pcall(nargs: CInt, nret: CInt, tracebackIndex msgh: CInt) throws {
+        guard let state = extraSpaceState(), state.lazyTraceback else {
+            if lua_pcall(self, nargs, nret, msgh) != LUA_OK {
+                throw LuaCallError.popFromStack(self)
+            }
+            return
+        }
+        let mark = state.beginTracebackCapture()
+        let err = lua_pcall(self, nargs, nret, msgh)
+        let tracebacks = state.endTracebackCapture(mark)
+        if err != LUA_OK {
+            throw LuaCallError.popFromStack(self, traceback: tracebacks.last)
+        }
     }
 
     /// Make a protected call to a Lua function.
@@ -2043,6 +2463,85 @@ extension UnsafeMutablePointer where Pointee == lua_State {
         }
     }
 
+    // Calls body in protected mode, with the top nargs values on the stack as its arguments (at stack indexes 1 to
+    // nargs). Equivalent to pushing body as a LuaClosure and calling it with pcall(), except that nothing needs to be
+    // allocated: the same C function is used every time, and body is passed to it as a light userdata pointing to
+    // this stack frame, which is safe because body cannot outlive the call.
+    internal func protectedCall(nargs: CInt, nret: CInt, traceback: Bool, _ body: (LuaState) throws -> CInt) throws {
+        _ = callProtectedRegistered
+        try withoutActuallyEscaping(body) { escapingBody in
+            var closure: LuaClosure = escapingBody
+            try withUnsafeMutablePointer(to: &closure) { ptr in
+                push(function: luaswift_callprotected, toindex: -(nargs + 1))
+                lua_pushlightuserdata(self, ptr)
+                try pcall(nargs: nargs + 1, nret: nret, traceback: traceback)
+            }
+        }
+    }
+
+    /// Push a message handler which is reused by subsequent protected calls on this thread.
+    ///
+    /// Normally each call to ``pcall(nargs:nret:traceback:)`` (and everything built on it, such as
+    /// ``LuaValue/pcall(arguments:traceback:)``) with `traceback: true` has to insert the traceback message handler
+    /// below the function and its arguments, and then remove it again afterwards, which means shuffling the contents of
+    /// the stack twice per call. This function instead pushes the handler once, at the current top of the stack, and
+    /// records its index. For as long as the handler remains at that index, protected calls made on this thread with
+    /// `traceback: true` pass it to `lua_pcall()` directly.
+    ///
+    /// This is typically called once, immediately after creating the state (or coroutine), so that the handler sits at
+    /// the base of the stack. Popping the handler (or otherwise replacing the value at that stack index) reverts to the
+    /// default behaviour, as does calling this function again on the same thread to move the handler to a new index.
+    public func pushResidentMessageHandler() {
+        let state = getState()
+        setExtraSpaceState(state)
+        if !isMetatableRegistered(for: ResidentMessageHandler.self) {
+            register(Metatable(for: ResidentMessageHandler.self))
+        }
+        let handler = ResidentMessageHandler(thread: self, state: state)
+        pushuserdata(handler)
+        lua_pushcclosure(self, defaultTracebackFn, 1)
+        state.residentMessageHandlers[self] = (index: gettop(), handler: ObjectIdentifier(handler))
+    }
+
+    // Returns the index of the resident message handler for this thread if there is one which can be used for a call
+    // with nargs arguments (ie it is below the function being called).
+    internal func residentMessageHandlerIndex(nargs: CInt) -> CInt? {
+        // This is called for every pcall with traceback: true, so avoid anything more than a couple of loads unless
+        // the state actually has a resident handler somewhere.
+        guard let state = extraSpaceState(),
+              !state.residentMessageHandlers.isEmpty,
+              let index = state.residentMessageHandlers[self]?.index,
+              index < gettop() - nargs,
+              let fn = lua_tocfunction(self, index),
+              unsafeBitCast(fn, to: UnsafeRawPointer.self) == unsafeBitCast(defaultTracebackFn as lua_CFunction, to: UnsafeRawPointer.self) else {
+            return nil
+        }
+        return index
+    }
+
+    /// Configure whether errors thrown by protected calls format their stack traceback immediately.
+    ///
+    /// By default, calls made with `traceback: true` format the full traceback of the Lua stack into the error string
+    /// at the point the error is raised, using
+    /// [`luaL_traceback()`](https://www.lua.org/manual/5.4/manual.html#luaL_traceback). This can be expensive,
+    /// particularly for code which uses errors for control flow and never examines the traceback. When `lazy` is
+    /// true, only the minimum information needed to describe each stack frame is captured at the point of the error,
+    /// and the traceback is only formatted the first time ``LuaCallError/errorString`` (or `description`) is
+    /// accessed. Lazily-formatted tracebacks name functions only according to how they were called (for example
+    /// `global 'error'` rather than `function 'error'`).
+    ///
+    /// Has no effect on calls made with `traceback: false` or with a custom `msgh`.
+    ///
+    /// - Parameter lazy: Whether to defer formatting tracebacks.
+    public func setLazyTraceback(_ lazy: Bool) {
+        let state = getState()
+        setExtraSpaceState(state)
+        state.lazyTraceback = lazy
+        if state.tracebackCaptureDepth == 0 {
+            state.pendingTracebacks.removeAll()
+        }
+    }
+
     /// Convenience zero-result wrapper around ``Lua/Swift/UnsafeMutablePointer/pcall(nargs:nret:traceback:)``.
     ///
     /// Make a protected call to a Lua function that must already be pushed
@@ -2106,7 +2605,7 @@ extension UnsafeMutablePointer where Pointee == lua_State {
 
     // MARK: - Registering metatables
 
-    private func makeMetatableName(for type: Any.Type) -> String {
+    internal func makeMetatableName(for type: Any.Type) -> String {
         let prefix = "LuaSwift_Type_" + String(describing: type)
         let state = getState()
         if state.metatableDict[prefix] == nil {
@@ -2127,7 +2626,9 @@ extension UnsafeMutablePointer where Pointee == lua_State {
     /// `register(DefaultMetatable)`.
     public func isMetatableRegistered<T>(for type: T.Type) -> Bool {
         let prefix = "LuaSwift_Type_" + String(describing: type)
-        if let state = maybeGetState(),
+        if let state = maybeGetState(), state.lazyMetatables[ObjectIdentifier(type)] != nil {
+            return true
+        } else if let state = maybeGetState(),
            let typesArray = state.metatableDict[prefix],
            let index = typesArray.firstIndex(where: { $0 == type }) {
             let name = index == 0 ? prefix : "\(prefix)[\(index)]"
@@ -2145,10 +2646,19 @@ extension UnsafeMutablePointer where Pointee == lua_State {
         case closure(LuaClosure)
     }
 
-    private func doRegisterMetatable(typeName: String, metafields: [MetafieldName: InternalMetafieldValue]? = nil) {
-        if luaL_newmetatable(self, typeName) == 0 {
+    private func doRegisterMetatable(typeName: String, metafields: [MetafieldName: InternalMetafieldValue]? = nil,
+                                     nfields: Int = 0, finalizer: Bool = true) {
+        // This is luaL_newmetatable(), except that the table is presized to hold all the fields which are about to be
+        // added: __name, __gc, __index if there are fields, and the fields themselves.
+        if luaL_getmetatable(self, typeName) != LUA_TNIL {
             preconditionFailure("Metatable for type \(typeName) is already registered!")
         }
+        pop()
+        lua_createtable(self, 0, CInt(clamping: 3 + (metafields?.count ?? 0) + nfields))
+        push(utf8String: typeName)
+        rawset(-2, utf8Key: "__name")
+        push(index: -1)
+        rawset(LUA_REGISTRYINDEX, utf8Key: typeName)
 
         if let metafields {
             for (name, function) in metafields {
@@ -2157,20 +2667,29 @@ extension UnsafeMutablePointer where Pointee == lua_State {
                     push(function: cfunction)
                 case .closure(let closure):
                     push(LuaClosureWrapper(closure))
+                case .wrapper(let wrapper):
+                    push(wrapper)
                 case .value(let value):
                     push(value)
+                case .fieldDispatch(let wrapper, let names):
+                    lua_createtable(self, 0, CInt(names.count))
+                    for (i, fieldName) in names.enumerated() {
+                        push(i + 1)
+                        rawset(-2, utf8Key: fieldName)
+                    }
+                    wrapper.push(onto: self, numUpvalues: 1)
                 }
                 rawset(-2, utf8Key: name.rawValue)
             }
         }
 
-        push(function: { L in
-            let rawptr = lua_touserdata(L, 1)!
-            let anyPtr = rawptr.bindMemory(to: Any.self, capacity: 1)
-            anyPtr.deinitialize(count: 1)
-            return 0
-        })
-        rawset(-2, utf8Key: "__gc")
+        if finalizer {
+            push(function: { L in
+                L.deinitUserdata(1, finalize: true)
+                return 0
+            })
+            rawset(-2, utf8Key: "__gc")
+        }
 
         // Leaves metatable on top of the stack
     }
@@ -2190,13 +2709,40 @@ extension UnsafeMutablePointer where Pointee == lua_State {
 
     // Documented in registerMetatable.md
     public func register<T>(_ metatable: Metatable<T>) {
-        doRegisterMetatable(typeName: makeMetatableName(for: T.self), metafields: metatable.mt)
+        register(type: T.self, metafields: metatable.mt, fields: metatable.unsynthesizedFields?.mapValues { $0.value })
+    }
 
-        if let fields = metatable.unsynthesizedFields {
+    // As above, but T must be a trivial type if finalizer is false, because values are then never deinitialized.
+    // Saves the garbage collector having to finalize every instance.
+    internal func register<T>(_ metatable: Metatable<T>, finalizer: Bool) {
+        precondition(finalizer || _isPOD(T.self), "Only trivial types can be registered without a finalizer")
+        register(type: T.self, metafields: metatable.mt, fields: metatable.unsynthesizedFields?.mapValues { $0.value },
+                 finalizer: finalizer)
+    }
+
+    internal func register(_ entry: MetatableBlueprint.Entry) {
+        register(type: entry.type, metafields: entry.metafields, fields: entry.fields)
+    }
+
+    internal func invalidateMetatableRef(for type: Any.Type) {
+        if let state = maybeGetState(), let ref = state.metatableRefs.removeValue(forKey: ObjectIdentifier(type)) {
+            luaL_unref(self, LUA_REGISTRYINDEX, ref)
+        }
+    }
+
+    private func register(type: Any.Type, metafields: [MetafieldName: InternalMetafieldValue],
+                          fields: [String: InternalUserdataField]?, finalizer: Bool = true) {
+        invalidateMetatableRef(for: type)
+        if let state = maybeGetState() {
+            state.lazyMetatables[ObjectIdentifier(type)] = nil
+        }
+        doRegisterMetatable(typeName: makeMetatableName(for: type), metafields: metafields, nfields: fields?.count ?? 0,
+                            finalizer: finalizer)
+
+        if let fields {
             addNonPropertyFieldsToMetatable(fields)
         }
 
-        getState().userdataMetatables.insert(lua_topointer(self, -1))
         pop() // metatable
     }
 
@@ -2209,9 +2755,8 @@ extension UnsafeMutablePointer where Pointee == lua_State {
         let mt = handleLegacyMetatableFunctions(functions, type: Any.self)
         doRegisterMetatable(typeName: Self.DefaultMetatableName, metafields: mt.mt)
         if let fields = mt.unsynthesizedFields {
-            addNonPropertyFieldsToMetatable(fields)
+            addNonPropertyFieldsToMetatable(fields.mapValues { $0.value })
         }
-        getState().userdataMetatables.insert(lua_topointer(self, -1))
         pop() // metatable
     }
 
@@ -2249,16 +2794,18 @@ extension UnsafeMutablePointer where Pointee == lua_State {
         return Metatable(for: T.self, legacyApiMetafields: metafields)
     }
 
-    private func addNonPropertyFieldsToMetatable<T>(_ fields: [String: Metatable<T>.FieldType]) {
+    private func addNonPropertyFieldsToMetatable(_ fields: [String: InternalUserdataField]) {
         push(index: -1)
         rawset(-2, utf8Key: "__index")
 
         for (k, v) in fields {
-            switch v.value {
+            switch v {
             case .function(let function):
                 push(function: function)
             case .closure(let closure):
                 push(closure)
+            case .wrapper(let wrapper):
+                push(wrapper)
             case .value(let value):
                 push(value)
             case .property(_), .rwproperty(_, _):
@@ -2283,7 +2830,6 @@ extension UnsafeMutablePointer where Pointee == lua_State {
     ///   it has been set.
     public func register(_ metatable: DefaultMetatable) {
         doRegisterMetatable(typeName: Self.DefaultMetatableName, metafields: metatable.mt)
-        getState().userdataMetatables.insert(lua_topointer(self, -1))
         pop() // metatable
     }
 
@@ -2347,6 +2893,11 @@ extension UnsafeMutablePointer where Pointee == lua_State {
     @discardableResult
     public func get(_ index: CInt) throws -> LuaType {
         let absidx = absindex(index)
+        if isPlainTable(absidx) {
+            // No metamethods can run, so nothing can error
+            lua_rawget(self, absidx)
+            return type(-1)!
+        }
         push(function: luaswift_gettable, toindex: -2) // Put the fn below key
         push(index: absidx, toindex: -2) // Put tbl below key
         try pcall(nargs: 2, nret: 1, traceback: false)
@@ -2494,6 +3045,10 @@ extension UnsafeMutablePointer where Pointee == lua_State {
     /// - Throws: ``LuaCallError`` if a Lua error is raised during the call to `lua_settable`.
     public func set(_ index: CInt) throws {
         let absidx = absindex(index)
+        if isPlainTable(absidx) && isValidTableKey(-2) {
+            lua_rawset(self, absidx)
+            return
+        }
         push(function: luaswift_settable, toindex: -3) // Put below key and val
         push(index: absidx, toindex: -3) // Put below key and val (and above function)
         try pcall(nargs: 3, nret: 0, traceback: false)
@@ -2531,6 +3086,33 @@ extension UnsafeMutablePointer where Pointee == lua_State {
         try set(absidx)
     }
 
+    // Returns true if the value at index is a table without a metatable, meaning get and set operations on it are
+    // equivalent to the raw ones.
+    @inline(__always)
+    internal func isPlainTable(_ index: CInt) -> Bool {
+        guard lua_type(self, index) == LUA_TTABLE else {
+            return false
+        }
+        if lua_getmetatable(self, index) == 0 {
+            return true
+        }
+        pop()
+        return false
+    }
+
+    // Returns false for nil and NaN, which error if used as a key with lua_rawset().
+    @inline(__always)
+    private func isValidTableKey(_ index: CInt) -> Bool {
+        switch lua_type(self, index) {
+        case LUA_TNIL:
+            return false
+        case LUA_TNUMBER:
+            return lua_isinteger(self, index) != 0 || !lua_tonumberx(self, index, nil).isNaN
+        default:
+            return true
+        }
+    }
+
     // MARK: - Misc functions
 
     /// Pushes the global called `name` on to the stack.
@@ -2712,22 +3294,34 @@ extension UnsafeMutablePointer where Pointee == lua_State {
     /// - Parameter index: The stack index of the value.
     /// - Returns: A `LuaValue` representing the value at the given stack index.
     public func ref(index: CInt) -> LuaValue {
-        push(index: index)
-        let type = type(-1)!
-        let ref = luaL_ref(self, LUA_REGISTRYINDEX)
-        if ref == LUA_REFNIL {
+        let storage: LuaValue.Storage
+        let t = lua_type(self, index)
+        switch t {
+        case LUA_TNIL, LUA_TNONE:
             return LuaValue()
-        } else {
-            let result = LuaValue(L: self, ref: ref, type: type)
-            getState().luaValues[ref] = UnownedLuaValue(val: result)
-            return result
+        case LUA_TBOOLEAN:
+            storage = .boolean(lua_toboolean(self, index) != 0)
+        case LUA_TNUMBER:
+            if lua_isinteger(self, index) != 0 {
+                storage = .integer(lua_tointegerx(self, index, nil))
+            } else {
+                storage = .number(lua_tonumberx(self, index, nil))
+            }
+        case LUA_TLIGHTUSERDATA:
+            storage = .lightuserdata(lua_touserdata(self, index))
+        default:
+            push(index: index)
+            storage = .ref(luaL_ref(self, LUA_REGISTRYINDEX))
         }
+        return LuaValue(L: self, storage: storage, type: LuaType(ctype: t)!)
     }
 
     // Used by LuaValue.deinit
-    internal func unref(_ ref: CInt) {
-        getState().luaValues[ref] = nil
-        luaL_unref(self, LUA_REGISTRYINDEX, ref)
+    internal func untrack(_ handle: LuaValueTable.Handle, ref: CInt?) {
+        getState().luaValues.remove(handle)
+        if let ref {
+            luaL_unref(self, LUA_REGISTRYINDEX, ref)
+        }
     }
 
     /// Convert any Swift value to a `LuaValue`.
@@ -2773,7 +3367,7 @@ extension UnsafeMutablePointer where Pointee == lua_State {
     /// ```
     public var globals: LuaValue {
         // Note, LUA_RIDX_GLOBALS doesn't need to be freed so doesn't need to be added to luaValues
-        return LuaValue(L: self, ref: LUA_RIDX_GLOBALS, type: .table)
+        return LuaValue(L: self, storage: .ref(LUA_RIDX_GLOBALS), type: .table)
     }
 
     /// Returns the raw length of a string, table or userdata.
@@ -2866,6 +3460,17 @@ extension UnsafeMutablePointer where Pointee == lua_State {
     public func compare(_ index1: CInt, _ index2: CInt, _ op: ComparisonOp) throws -> Bool {
         let i1 = absindex(index1)
         let i2 = absindex(index2)
+        // Metamethods are only considered when comparing two tables or two full userdata for equality, or when
+        // ordering anything other than two numbers or two strings. In all other cases the comparison cannot error.
+        let t1 = lua_type(self, i1)
+        let t2 = lua_type(self, i2)
+        if op == .eq {
+            if t1 != t2 || (t1 != LUA_TTABLE && t1 != LUA_TUSERDATA) {
+                return lua_rawequal(self, i1, i2) != 0
+            }
+        } else if t1 == t2 && (t1 == LUA_TNUMBER || t1 == LUA_TSTRING) {
+            return lua_compare(self, i1, i2, op.rawValue) != 0
+        }
         push(function: luaswift_compare)
         push(index: i1)
         push(index: i2)
@@ -2881,6 +3486,9 @@ extension UnsafeMutablePointer where Pointee == lua_State {
     ///
     /// Unless coroutines are being used, this will be the same as `self`.
     public func getMainThread() -> LuaState {
+        if let extraspace = luaswift_getextraspace(self), let statePtr = extraspace.pointee {
+            return Unmanaged<_State>.fromOpaque(statePtr).takeUnretainedValue().mainThread
+        }
         rawget(LUA_REGISTRYINDEX, key: LUA_RIDX_MAINTHREAD)
         defer {
             pop()
@@ -3214,14 +3822,62 @@ extension UnsafeMutablePointer where Pointee == lua_State {
     /// - Returns: An instance of type `T`.
     /// - Throws: an ``argumentError(_:_:)`` if the specified argument cannot be converted to type `T`. Argument
     ///   conversion is performed according to ``tovalue(_:)``.
+    @_specialize(where T == Int)
+    @_specialize(where T == Int64)
+    @_specialize(where T == Double)
+    @_specialize(where T == String)
+    @_specialize(where T == Bool)
     public func checkArgument<T>(_ arg: CInt) throws -> T {
-        if let val: T = tovalue(arg) {
+        if let val: T = checkArgumentFastPath(arg) {
+            return val
+        } else if let val: T = tovalue(arg) {
             return val
         } else {
             throw argumentError(arg, "Expected type convertible to \(String(describing: T.self)), got \(typename(index: arg))")
         }
     }
 
+    // Converts the commonest argument types (integers, doubles, strings, bools and userdata) without going through
+    // toany() and the cast probes in tovalue(). This only ever returns a value which tovalue() would also have
+    // returned, anything else returns nil and the caller falls back to tovalue() so the semantics and errors are
+    // unchanged. The T.self comparisons are resolved at compile time in the specializations of checkArgument().
+    @inline(__always)
+    internal func checkArgumentFastPath<T>(_ arg: CInt) -> T? {
+        switch lua_type(self, arg) {
+        case LUA_TNUMBER:
+            if T.self == Int.self || T.self == Int64.self {
+                var isnum: CInt = 0
+                let val = lua_tointegerx(self, arg, &isnum)
+                if isnum == 0 {
+                    return nil
+                } else if T.self == Int64.self {
+                    return unsafeBitCast(Int64(val), to: T.self)
+                } else if let intVal = Int(exactly: val) {
+                    return unsafeBitCast(intVal, to: T.self)
+                }
+            } else if T.self == Double.self {
+                if lua_isinteger(self, arg) == 0 {
+                    return unsafeBitCast(lua_tonumberx(self, arg, nil), to: T.self)
+                } else if let dblVal = Double(exactly: lua_tointegerx(self, arg, nil)) {
+                    return unsafeBitCast(dblVal, to: T.self)
+                }
+            }
+        case LUA_TBOOLEAN:
+            if T.self == Bool.self {
+                return unsafeBitCast(lua_toboolean(self, arg) != 0, to: T.self)
+            }
+        case LUA_TSTRING:
+            if T.self == String.self, let str = tostring(arg) {
+                return unsafeBitCast(str, to: T.self)
+            }
+        case LUA_TUSERDATA:
+            return touserdata(arg)
+        default:
+            break
+        }
+        return nil
+    }
+
     /// Checks if an function argument is of the correct type.
     ///
     /// This function behaves identically to ``checkArgument(_:)`` except for having an explicit `type:` parameter to force
@@ -47,38 +47,92 @@ import CLua
 /// `LuaState` has been closed, however.
 ///
 /// 
-/// Note that while `LuaValue` is `Equatable`, it does not compare the underlying values. Only two instances which have
-/// the same `luaL_ref` ref compare equal. Similarly `LuaValue` is `Hashable`, but will not return the same hash value
-/// as the underlying Lua value, in a similar way to how `AnyHashable` behaves.
+/// Note that while `LuaValue` is `Equatable`, it does not in general compare the underlying values. Only two instances
+/// which have the same `luaL_ref` ref compare equal, except that booleans, numbers and light userdata (which are
+/// stored directly in the `LuaValue` rather than using a ref) compare equal if they have the same Lua subtype and the
+/// same value. This means an integer never equals a float even if they are numerically equal (so `1` and `1.0` are
+/// different), and floats are compared by bit pattern, so that (unlike in Lua) a NaN equals itself and `0.0` does not
+/// equal `-0.0`. Similarly `LuaValue` is `Hashable`, but will not return the same hash value as the underlying Lua
+/// value, in a similar way to how `AnyHashable` behaves.
 @dynamicCallable
 public class LuaValue: Equatable, Hashable, Pushable {
     internal var L: LuaState!
-    private let ref: CInt
+
+    // Values which cannot be collected are stored inline, everything else uses a registry ref.
+    internal enum Storage: Hashable {
+        case ref(CInt)
+        case boolean(Bool)
+        case integer(lua_Integer)
+        case number(lua_Number)
+        case lightuserdata(UnsafeMutableRawPointer?)
+
+        // Numbers are compared by bit pattern, because the synthesized conformance would make a NaN unequal to
+        // itself, which breaks the Equatable (and Hashable) contract.
+        static func == (lhs: Storage, rhs: Storage) -> Bool {
+            switch (lhs, rhs) {
+            case (.ref(let l), .ref(let r)): return l == r
+            case (.boolean(let l), .boolean(let r)): return l == r
+            case (.integer(let l), .integer(let r)): return l == r
+            case (.number(let l), .number(let r)): return l.bitPattern == r.bitPattern
+            case (.lightuserdata(let l), .lightuserdata(let r)): return l == r
+            default: return false
+            }
+        }
+
+        func hash(into hasher: inout Hasher) {
+            switch self {
+            case .ref(let ref):
+                hasher.combine(0)
+                hasher.combine(ref)
+            case .boolean(let bool):
+                hasher.combine(1)
+                hasher.combine(bool)
+            case .integer(let int):
+                hasher.combine(2)
+                hasher.combine(int)
+            case .number(let num):
+                hasher.combine(3)
+                hasher.combine(num.bitPattern)
+            case .lightuserdata(let ptr):
+                hasher.combine(4)
+                hasher.combine(ptr)
+            }
+        }
+    }
+
+    private let storage: Storage
+    private var handle = LuaValueTable.Handle.none
 
     /// The type of the value this `LuaValue` represents.
     public let type: LuaType
 
-    // Takes ownership of an existing ref
-    internal init(L: LuaState, ref: CInt, type: LuaType) {
+    // Takes ownership of an existing ref, if storage is a ref
+    internal init(L: LuaState, storage: Storage, type: LuaType) {
         self.L = L
         self.type = type
-        self.ref = ref
+        self.storage = storage
+        // LUA_RIDX_GLOBALS is not actually a luaL_ref (despite otherwise acting like one) so must not be tracked, as
+        // it mustn't be unref'd. Inline values have no ref, but are still tracked so that L is nilled when the state
+        // is closed, because their to...() functions and the use-after-close precondition rely on it.
+        if storage != .ref(LUA_RIDX_GLOBALS) {
+            handle = L.getState().luaValues.insert(self)
+        }
     }
 
     /// Construct a `LuaValue` representing `nil`.
     public init() {
         self.L = nil
         self.type = .nil
-        self.ref = LUA_REFNIL
+        self.storage = .ref(LUA_REFNIL)
     }
 
     deinit {
-        // LUA_RIDX_GLOBALS is not actually a luaL_ref (despite otherwise acting like one) so doesn't need to be
-        // unref'd (and mustn't be, because it is not tracked in _State.luaValues thus L won't be nilled if the
-        // state is closed). `LuaValue`s representing `nil` are never tracked either.
-        if ref != LUA_RIDX_GLOBALS && ref != LUA_REFNIL {
-            if let L {
-                L.unref(ref)
+        // Globals and `LuaValue`s representing `nil` are never tracked, and nothing needs doing once L is closed.
+        if handle.isValid, let L {
+            if case .ref(let ref) = storage {
+                L.untrack(handle, ref: ref)
+            } else {
+                L.untrack(handle, ref: nil)
             }
         }
     }
@@ -86,12 +140,12 @@ public class LuaValue: Equatable, Hashable, Pushable {
     internal static let nilValue = LuaValue()
 
     public static func == (lhs: LuaValue, rhs: LuaValue) -> Bool {
-        return lhs.L == rhs.L && lhs.ref == rhs.ref
+        return lhs === rhs || (lhs.L == rhs.L && lhs.storage == rhs.storage)
     }
 
     public func hash(into hasher: inout Hasher) {
         L.hash(into: &hasher)
-        ref.hash(into: &hasher)
+        storage.hash(into: &hasher)
     }
 
     /// Convenience API to create a LuaValue referencing a new empty table.
@@ -104,12 +158,27 @@ public class LuaValue: Equatable, Hashable, Pushable {
     ///
     /// - Note: `L` must be related to the `LuaState` used to construct the object.
     public func push(onto L: LuaState) {
-        if ref == LUA_REFNIL {
-            L.pushnil()
-        } else {
+        switch storage {
+        case .ref(let ref):
+            if ref == LUA_REFNIL {
+                L.pushnil()
+            } else {
+                precondition(self.L != nil, "LuaValue used after LuaState has been deinited!")
+                checkRelated(self.L, L, "Cannot push a LuaValue onto an unrelated state")
+                lua_rawgeti(L, LUA_REGISTRYINDEX, lua_Integer(ref))
+            }
+        case .boolean(let val):
             precondition(self.L != nil, "LuaValue used after LuaState has been deinited!")
-            precondition(self.L.getMainThread() == L.getMainThread(), "Cannot push a LuaValue onto an unrelated state")
-            lua_rawgeti(L, LUA_REGISTRYINDEX, lua_Integer(self.ref))
+            lua_pushboolean(L, val ? 1 : 0)
+        case .integer(let val):
+            precondition(self.L != nil, "LuaValue used after LuaState has been deinited!")
+            lua_pushinteger(L, val)
+        case .number(let val):
+            precondition(self.L != nil, "LuaValue used after LuaState has been deinited!")
+            lua_pushnumber(L, val)
+        case .lightuserdata(let val):
+            precondition(self.L != nil, "LuaValue used after LuaState has been deinited!")
+            lua_pushlightuserdata(L, val)
         }
     }
 
@@ -247,7 +316,7 @@ public class LuaValue: Equatable, Hashable, Pushable {
     }
 
     // On error, pops stack top
-    private static func checkTopIsCallable(_ L: LuaState!) throws {
+    internal static func checkTopIsCallable(_ L: LuaState!) throws {
         if L.type(-1) != .function {
             let callMetafieldType = luaL_getmetafield(L, -1, "__call")
             if callMetafieldType != LUA_TNIL {
@@ -503,7 +572,16 @@ public class LuaValue: Equatable, Hashable, Pushable {
         }
         public func next() -> (lua_Integer, LuaValue)? {
             i = i + 1
-            let val = value[i]
+            // Same semantics as value[i], but without repeating the indexable check or going through push(any:)
+            let L = value.L!
+            value.push(onto: L)
+            defer {
+                L.pop()
+            }
+            guard let _ = try? L.get(-1, key: i) else {
+                return nil
+            }
+            let val = L.popref()
             if val.type != .nil {
                 return (i, val)
             } else {
@@ -626,15 +704,56 @@ public class LuaValue: Equatable, Hashable, Pushable {
     ///           ``LuaValueError/notIndexable`` if the Lua value does not support indexing.
     ///           ``LuaCallError`` if an error is thrown during an `__index` call.
     public func for_ipairs(start: lua_Integer = 1, block: (lua_Integer, LuaValue) throws -> Bool) throws {
+        try for_ipairs(start: start, borrowed: { i, value in
+            return try block(i, value.ref())
+        })
+    }
+
+    /// Calls the given closure with each array element in order, without creating a `LuaValue` for each element.
+    ///
+    /// Behaves identically to ``for_ipairs(start:block:)`` except that each value is passed to `block` as a
+    /// ``LuaBorrowedValue``, which is only valid until `block` returns, rather than as a `LuaValue`. No registry refs
+    /// are created unless `block` calls ``LuaBorrowedValue/ref()``, and if the value is a table without a metatable,
+    /// no protected calls are made either.
+    ///
+    /// ```swift
+    /// var total = 0
+    /// try foo.for_ipairs(borrowed: { i, val in
+    ///     total += val.toint() ?? 0
+    ///     return true
+    /// })
+    /// ```
+    ///
+    /// - Parameter start: What table index to start iterating from. Default is `1`, ie the start of the array.
+    /// - Throws: ``LuaValueError/nilValue`` if the Lua value associated with `self` is `nil`.
+    ///           ``LuaValueError/notIndexable`` if the Lua value does not support indexing.
+    ///           ``LuaCallError`` if an error is thrown during an `__index` call.
+    public func for_ipairs(start: lua_Integer = 1, borrowed block: (lua_Integer, LuaBorrowedValue) throws -> Bool) throws {
         try checkValid()
         push(onto: L)
         try Self.checkTopIsIndexable(L)
+        let top = L.gettop()
         defer {
-            L.pop()
+            L.settop(top - 1)
+        }
+        if L.isPlainTable(top) {
+            // No metamethods can run, so nothing can error
+            var i = start
+            while true {
+                L.settop(top)
+                if lua_rawgeti(L, top, i) == LUA_TNIL {
+                    break
+                }
+                let shouldContinue = try block(i, LuaBorrowedValue(L: L, index: top + 1))
+                if !shouldContinue {
+                    break
+                }
+                i = i + 1
+            }
+            return
         }
-        try L.for_ipairs(-1, start: start) { i in
-            let value = L.popref()
-            return try block(i, value)
+        try L.for_ipairs(top, start: start) { i in
+            return try block(i, LuaBorrowedValue(L: L, index: L.gettop()))
         }
     }
 
@@ -657,8 +776,54 @@ public class LuaValue: Equatable, Hashable, Pushable {
     ///           ``LuaValueError/notIterable`` if the Lua value is not a table and does not have a `__pairs` metafield.
     ///           ``LuaCallError`` if an error is thrown during a `__pairs` or iterator call.
     public func for_pairs(block: (LuaValue, LuaValue) throws -> Bool) throws {
+        try for_pairs(borrowed: { key, value in
+            return try block(key.ref(), value.ref())
+        })
+    }
+
+    /// Iterate a Lua table-like value, calling `block` for each member, without creating a `LuaValue` for each member.
+    ///
+    /// Behaves identically to ``for_pairs(block:)`` except that each key and value is passed to `block` as a
+    /// ``LuaBorrowedValue``, which is only valid until `block` returns, rather than as a `LuaValue`. No registry refs
+    /// are created unless `block` calls ``LuaBorrowedValue/ref()``, and if the value is a table without a metatable,
+    /// it is iterated using `lua_next` without making any protected calls.
+    ///
+    /// ```swift
+    /// let foo = L.ref(any: ["a": 1, "b": 2, "c": 3])
+    /// try foo.for_pairs(borrowed: { key, value in
+    ///     print("\(key.tostring()!) \(value.toint()!)")
+    ///     return true // continue iteration
+    /// })
+    /// ```
+    ///
+    /// - Parameter block: The code to execute.
+    /// - Throws: ``LuaValueError/nilValue`` if the Lua value associated with `self` is nil.
+    ///           ``LuaValueError/notIterable`` if the Lua value is not a table and does not have a `__pairs` metafield.
+    ///           ``LuaCallError`` if an error is thrown during a `__pairs` or iterator call.
+    public func for_pairs(borrowed block: (LuaBorrowedValue, LuaBorrowedValue) throws -> Bool) throws {
         try checkValid()
         push(onto: L)
+        let top = L.gettop()
+        if L.isPlainTable(top) {
+            defer {
+                L.settop(top - 1)
+            }
+            L.pushnil()
+            while lua_next(L, top) != 0 {
+                let shouldContinue = try block(LuaBorrowedValue(L: L, index: top + 1),
+                                               LuaBorrowedValue(L: L, index: top + 2))
+                if !shouldContinue {
+                    break
+                }
+                if L.gettop() < top + 1 {
+                    // The block better not have messed up the stack, we rely on the key staying valid
+                    fatalError("Iteration popped more items from the stack than it pushed")
+                }
+                L.settop(top + 1) // Pop everything except the key
+            }
+            return
+        }
+
         let iterable = try L.pushPairsParameters() // pops self, pushes iterfn, state, initval
         if !iterable {
             L.pop(3) // iterfn, state, initval
@@ -666,9 +831,7 @@ public class LuaValue: Equatable, Hashable, Pushable {
         }
 
         try L.do_for_pairs() { k, v in
-            let key = L.ref(index: k)
-            let value = L.ref(index: v)
-            return try block(key, value)
+            return try block(LuaBorrowedValue(L: L, index: k), LuaBorrowedValue(L: L, index: v))
         }
     }
 
@@ -700,7 +863,7 @@ public class LuaValue: Equatable, Hashable, Pushable {
     /// - Parameter other: The value to compare against.
     /// - Returns: true if the two values are equal according to the definition of raw equality.
     public func rawequal(_ other: LuaValue) -> Bool {
-        precondition(L.getMainThread() == other.L.getMainThread(), "Cannot compare LuaValues from different LuaStates")
+        checkRelated(L, other.L, "Cannot compare LuaValues from different LuaStates")
         L.push(self)
         L.push(other)
         defer {
@@ -725,7 +888,7 @@ public class LuaValue: Equatable, Hashable, Pushable {
     /// - Returns: true if the comparison is satisfied.
     /// - Throws: ``LuaCallError`` if a metamethod errored.
     public func compare(_ other: LuaValue, _ op: LuaState.ComparisonOp) throws -> Bool {
-        precondition(L.getMainThread() == other.L.getMainThread(), "Cannot compare LuaValues from different LuaStates")
+        checkRelated(L, other.L, "Cannot compare LuaValues from different LuaStates")
         L.push(self)
         L.push(other)
         defer {
@@ -736,6 +899,70 @@ public class LuaValue: Equatable, Hashable, Pushable {
 
 }
 
-struct UnownedLuaValue {
-    unowned let val: LuaValue
+// Checks two states share the same main thread. This is compiled out if LUASWIFT_UNCHECKED is defined, for release
+// configurations which don't want to pay for checks that only catch programming errors.
+@inline(__always)
+internal func checkRelated(_ lhs: LuaState, _ rhs: LuaState, _ message: StaticString) {
+#if !LUASWIFT_UNCHECKED
+    precondition(lhs == rhs || lhs.getMainThread() == rhs.getMainThread(), message)
+#endif
+}
+
+// The LuaValues which must be invalidated if the state is closed. This is a slab of slots with an intrusive free list,
+// so that creating and releasing a LuaValue never allocates once the slab has grown to the number of live values.
+// Each slot has a generation which is incremented every time it is freed, so that a stale handle is caught rather
+// than releasing whichever LuaValue has since been given the slot.
+struct LuaValueTable {
+    struct Handle {
+        let index: Int
+        let generation: UInt32
+
+        static let none = Handle(index: -1, generation: 0)
+
+        var isValid: Bool {
+            return index >= 0
+        }
+    }
+
+    private struct Slot {
+        // Every LuaValue removes itself in its deinit, so the references can never dangle and don't need the
+        // overhead of being unowned(safe).
+        var value: Unmanaged<LuaValue>?
+        var generation: UInt32
+        var nextFree: Int
+    }
+
+    private var slots: [Slot] = []
+    private var firstFree = -1
+    // The number of live LuaValues
+    private(set) var count = 0
+
+    mutating func insert(_ val: LuaValue) -> Handle {
+        let index: Int
+        if firstFree >= 0 {
+            index = firstFree
+            firstFree = slots[index].nextFree
+            slots[index].value = Unmanaged.passUnretained(val)
+        } else {
+            index = slots.count
+            slots.append(Slot(value: Unmanaged.passUnretained(val), generation: 0, nextFree: -1))
+        }
+        count += 1
+        return Handle(index: index, generation: slots[index].generation)
+    }
+
+    mutating func remove(_ handle: Handle) {
+        precondition(slots[handle.index].generation == handle.generation, "Stale LuaValue handle")
+        slots[handle.index].value = nil
+        slots[handle.index].generation &+= 1
+        slots[handle.index].nextFree = firstFree
+        firstFree = handle.index
+        count -= 1
+    }
+
+    func invalidateAll() {
+        for slot in slots {
+            slot.value?.takeUnretainedValue().L = nil
+        }
+    }
 }
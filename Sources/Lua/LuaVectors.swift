@@ -0,0 +1,133 @@
+// Copyright (c) 2023 Tom Sutcliffe
+// See LICENSE file for license information.
+
+import CLua
+
+extension UnsafeMutablePointer where Pointee == lua_State {
+
+    /// Open the vector library, and make it available as the global `vector`.
+    ///
+    /// The vector library provides 2, 3 and 4-component vectors and 4x4 matrices of `lua_Number`, as userdata values
+    /// which support the usual arithmetic operators. For example:
+    ///
+    /// ```lua
+    /// local a = vector.new(1, 2, 3)
+    /// local b = vector.new(4, 5, 6)
+    /// local c = (a + b) * 2 -- vector(10, 14, 18)
+    /// print(c.x, c[2], #c, a:dot(b), a:cross(b):length())
+    /// local p = vector.identity() * vector.new(1, 2, 3, 1)
+    /// ```
+    ///
+    /// Vectors and matrices are immutable, like numbers. The functions available in the `vector` table, and as methods
+    /// on the values, are:
+    ///
+    /// * `vector.new(x, y, [z, [w]])`: create a vector.
+    /// * `vector.matrix(m1, ..., m16)`: create a matrix from 16 numbers in column-major order.
+    /// * `vector.identity()`: create an identity matrix.
+    /// * `vector.dot(a, b)`, `vector.cross(a, b)` (3-component vectors only), `vector.length(v)`,
+    ///   `vector.normalize(v)` and `vector.transpose(m)`.
+    ///
+    /// `+` and `-` operate element-wise on vectors of the same size, `*` and `/` operate element-wise on two vectors or
+    /// scale a vector by a number. A matrix can be multiplied by another matrix, by a 4-component vector, or by a
+    /// number. Vector components can be accessed as `v.x`, `v.y`, `v.z` and `v.w`, or `v[1]` to `v[4]`; matrix
+    /// elements as `m[1]` to `m[16]` in column-major order. `#v` is the number of components in `v`.
+    ///
+    /// All the metamethods are implemented in C and the values are stored inline in the userdata, so operations on
+    /// vectors are considerably cheaper than the equivalent operations on tables. Use ``push(vector:toindex:)``,
+    /// ``tovector(_:)``, ``push(matrix:toindex:)`` and ``tomatrix(_:)`` to convert between these values and Swift
+    /// `SIMD` types.
+    ///
+    /// Calling this function more than once has no further effect other than to reset the `vector` global.
+    public func openVectorLibrary() {
+        // The payloads are plain C structs, so no __gc is needed, which spares the collector from finalizing every
+        // vector. The metamethods themselves are added by luaswift_openvectorlib(), as closures which have the
+        // templates and metatables as upvalues. Calling this again just resets the vector global.
+        if !isMetatableRegistered(for: luaswift_Vector.self) {
+            register(Metatable(for: luaswift_Vector.self), finalizer: false)
+            register(Metatable(for: luaswift_Matrix4.self), finalizer: false)
+        }
+
+        checkstack(4)
+        push(vector: SIMD2<Double>())
+        push(matrix: SIMD16<Double>())
+        newtable(nrec: 5) // methods
+        newtable(nrec: 8) // library
+        luaswift_openvectorlib(self, Self.UserdataHeaderSize)
+        setglobal(name: "vector")
+    }
+
+    /// Push a vector created by the vector library on to the stack.
+    ///
+    /// See ``openVectorLibrary()``, which must have been called before using this function.
+    ///
+    /// - Parameter vector: The vector to push.
+    /// - Parameter toindex: See <doc:LuaState#Push-functions-toindex-parameter>.
+    /// - Precondition: `vector` must have 2, 3 or 4 components.
+    public func push<V: SIMD>(vector: V, toindex: CInt = -1) where V.Scalar == lua_Number {
+        precondition(vector.scalarCount >= 2 && vector.scalarCount <= 4, "Vectors must have 2, 3 or 4 components")
+        var value = luaswift_Vector(n: lua_Integer(vector.scalarCount), v: (0, 0, 0, 0))
+        withUnsafeMutableBytes(of: &value.v) { buf in
+            for i in vector.indices {
+                buf.storeBytes(of: vector[i], toByteOffset: i * MemoryLayout<lua_Number>.stride, as: lua_Number.self)
+            }
+        }
+        push(userdata: value, toindex: toindex)
+    }
+
+    /// Convert a vector created by the vector library to a Swift `SIMD` type.
+    ///
+    /// See ``openVectorLibrary()``.
+    ///
+    /// - Parameter index: The stack index of the value.
+    /// - Returns: The vector, or `nil` if the value is not a vector or has a different number of components to `V`.
+    public func tovector<V: SIMD>(_ index: CInt) -> V? where V.Scalar == lua_Number {
+        guard let value: luaswift_Vector = touserdata(index) else {
+            return nil
+        }
+        var result = V()
+        guard value.n == result.scalarCount else {
+            return nil
+        }
+        withUnsafeBytes(of: value.v) { buf in
+            for i in result.indices {
+                result[i] = buf.load(fromByteOffset: i * MemoryLayout<lua_Number>.stride, as: lua_Number.self)
+            }
+        }
+        return result
+    }
+
+    /// Push a 4x4 matrix created by the vector library on to the stack.
+    ///
+    /// See ``openVectorLibrary()``, which must have been called before using this function.
+    ///
+    /// - Parameter matrix: The matrix elements, in column-major order.
+    /// - Parameter toindex: See <doc:LuaState#Push-functions-toindex-parameter>.
+    public func push(matrix: SIMD16<lua_Number>, toindex: CInt = -1) {
+        var value = luaswift_Matrix4()
+        withUnsafeMutableBytes(of: &value.m) { buf in
+            for i in matrix.indices {
+                buf.storeBytes(of: matrix[i], toByteOffset: i * MemoryLayout<lua_Number>.stride, as: lua_Number.self)
+            }
+        }
+        push(userdata: value, toindex: toindex)
+    }
+
+    /// Convert a matrix created by the vector library to a Swift `SIMD16`.
+    ///
+    /// See ``openVectorLibrary()``.
+    ///
+    /// - Parameter index: The stack index of the value.
+    /// - Returns: The matrix elements in column-major order, or `nil` if the value is not a matrix.
+    public func tomatrix(_ index: CInt) -> SIMD16<lua_Number>? {
+        guard let value: luaswift_Matrix4 = touserdata(index) else {
+            return nil
+        }
+        var result = SIMD16<lua_Number>()
+        withUnsafeBytes(of: value.m) { buf in
+            for i in result.indices {
+                result[i] = buf.load(fromByteOffset: i * MemoryLayout<lua_Number>.stride, as: lua_Number.self)
+            }
+        }
+        return result
+    }
+}
@@ -0,0 +1,94 @@
+// Copyright (c) 2023 Tom Sutcliffe
+// See LICENSE file for license information.
+
+import CLua
+
+/// A set of metatables which can be registered with many `LuaState`s.
+///
+/// An application which creates many Lua states (for example one per request or per document) normally has to call
+/// ``Lua/Swift/UnsafeMutablePointer/register(_:)-8rgnn`` for every bridged type on every new state. A
+/// `MetatableBlueprint` collects those metatables once, doing as much of the preparation as possible up front (for
+/// example, closures are wrapped once and the wrappers are shared by every state), and then registers them all
+/// with a single call to ``Lua/Swift/UnsafeMutablePointer/register(_:lazily:)``:
+///
+/// ```swift
+/// let blueprint: MetatableBlueprint = {
+///     var blueprint = MetatableBlueprint()
+///     blueprint.add(Metatable(for: Foo.self, fields: [ /* ... */ ]))
+///     blueprint.add(Metatable(for: Bar.self, fields: [ /* ... */ ]))
+///     return blueprint
+/// }()
+///
+/// // For each new state
+/// L.register(blueprint, lazily: true)
+/// ```
+///
+/// A blueprint does not refer to any particular `LuaState`, so it can be created once (for example in a `static let`)
+/// and used with any number of states. For the same reason, metatables which contain a `.value(LuaValue)` should not
+/// be added to a blueprint which will be used with states other than the one the `LuaValue` belongs to.
+public struct MetatableBlueprint {
+    internal struct Entry {
+        let type: Any.Type
+        let metafields: [MetafieldName: InternalMetafieldValue]
+        let fields: [String: InternalUserdataField]?
+    }
+
+    internal private(set) var entries: [Entry] = []
+
+    /// Create an empty blueprint.
+    public init() {}
+
+    /// Add a metatable to the blueprint.
+    ///
+    /// - Precondition: A metatable for the same type must not already have been added.
+    public mutating func add<T>(_ metatable: Metatable<T>) {
+        precondition(!entries.contains(where: { $0.type == T.self }),
+            "A metatable for type \(T.self) has already been added to the blueprint")
+        let metafields = metatable.mt.mapValues { value in
+            if case .closure(let closure) = value {
+                return InternalMetafieldValue.wrapper(LuaClosureWrapper(closure))
+            }
+            return value
+        }
+        let fields = metatable.unsynthesizedFields?.mapValues { field in
+            if case .closure(let closure) = field.value {
+                return InternalUserdataField.wrapper(LuaClosureWrapper(closure))
+            }
+            return field.value
+        }
+        entries.append(Entry(type: T.self, metafields: metafields, fields: fields))
+    }
+}
+
+extension UnsafeMutablePointer where Pointee == lua_State {
+
+    /// Register all the metatables in a blueprint.
+    ///
+    /// Equivalent to calling ``register(_:)-8rgnn`` for each of the metatables added to `blueprint`. If `lazily` is
+    /// true, each metatable is instead only registered the first time a value of its type is pushed (or the metatable
+    /// is otherwise needed), meaning that a state which only ever uses a few of the types in a large blueprint only
+    /// pays for creating the metatables it uses. ``isMetatableRegistered(for:)`` returns true for types whose
+    /// metatable is pending lazy registration.
+    ///
+    /// A later call to `register(_:)` for a type whose metatable is still pending lazy registration replaces the
+    /// blueprint's metatable for that type.
+    ///
+    /// - Parameter blueprint: The metatables to register.
+    /// - Parameter lazily: Whether to defer registering each metatable until it is first needed.
+    /// - Precondition: If `lazily` is false, none of the types in the blueprint may already have a metatable
+    ///   registered.
+    public func register(_ blueprint: MetatableBlueprint, lazily: Bool = false) {
+        if lazily {
+            let state = getState()
+            for entry in blueprint.entries {
+                // In case the default metatable was cached for this type
+                invalidateMetatableRef(for: entry.type)
+                state.lazyMetatables[ObjectIdentifier(entry.type)] = entry
+            }
+        } else {
+            for entry in blueprint.entries {
+                register(entry)
+            }
+        }
+    }
+}
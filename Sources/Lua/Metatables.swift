@@ -34,6 +34,11 @@ internal enum InternalMetafieldValue {
     case function(lua_CFunction)
     case closure(LuaClosure)
     case value(LuaValue)
+    // A closure which has already been wrapped, so the wrapper can be shared between states. See MetatableBlueprint.
+    case wrapper(LuaClosureWrapper)
+    // A closure whose first upvalue is a table mapping each of the names to its (1-based) index in the array, so that
+    // it can dispatch on a key without converting it to a Swift String. See fieldSlot().
+    case fieldDispatch(LuaClosureWrapper, names: [String])
 }
 
 /// Describes a metatable to be used in a call to ``Lua/Swift/UnsafeMutablePointer/register(_:)-4rb3q``.
@@ -203,11 +208,18 @@ public struct Metatable<T> {
         }
         // Not specifiable directly - used by impl of fields
         internal static func synthesize(fields: [String: FieldType]) -> InternalMetafieldValue {
-            return .closure { L in
-                guard let memberName = L.tostringUtf8(2) else {
-                    throw L.argumentError(2, "expected UTF-8 string member name")
+            let names = Array(fields.keys)
+            let values = names.map { fields[$0]!.value }
+            return .fieldDispatch(LuaClosureWrapper { L in
+                guard let slot = L.fieldSlot() else {
+                    // Only convert the key to a string on a miss, to distinguish a non-string key from an unknown one
+                    guard L.tostringUtf8(2) != nil else {
+                        throw L.argumentError(2, "expected UTF-8 string member name")
+                    }
+                    L.pushnil()
+                    return 1
                 }
-                switch fields[memberName]?.value {
+                switch values[slot] {
                 case .property(let getter):
                     return try getter(L)
                 case .rwproperty(let getter, _):
@@ -216,13 +228,13 @@ public struct Metatable<T> {
                     L.push(function: fn)
                 case .closure(let closure):
                     L.push(closure)
+                case .wrapper(let wrapper):
+                    L.push(wrapper)
                 case .value(let value):
                     L.push(value)
-                case .none:
-                    L.pushnil()
                 }
                 return 1
-            }
+            }, names: names)
         }
     }
 
@@ -296,14 +308,12 @@ public struct Metatable<T> {
         /// may be problematic for some scenarios, hence it is recommended such types should implement `Closable`.
         public static var synthesize: Self {
             return .function { L in
-                let rawptr = lua_touserdata(L, 1)!
-                let anyPtr = rawptr.bindMemory(to: Any.self, capacity: 1)
-                if let closable = anyPtr.pointee as? Closable {
+                if let closable: Closable = L.touserdata(1) {
                     closable.close()
                 } else {
-                    anyPtr.deinitialize(count: 1)
-                    // Leave anyPtr in a safe state for __gc
-                    anyPtr.initialize(to: false)
+                    // Marks the userdata as closed, so touserdata() will no longer return it and __gc won't deinit
+                    // it again.
+                    L.deinitUserdata(1, finalize: false)
                 }
                 return 0
             }
@@ -411,17 +421,17 @@ public struct Metatable<T> {
                 if anyRwProperties {
                     precondition(newindex == nil,
                         "If any properties with setters are specified, newindex must be nil")
-                    mt[.newindex] = .closure { L in
+                    let names = Array(fields.keys)
+                    let values = names.map { fields[$0]!.value }
+                    mt[.newindex] = .fieldDispatch(LuaClosureWrapper { L in
+                        if let slot = L.fieldSlot(), case .rwproperty(_, let setter) = values[slot] {
+                            return try setter(L)
+                        }
                         guard let memberName = L.tostringUtf8(2) else {
                             throw L.argumentError(2, "expected UTF-8 string member name")
                         }
-                        switch fields[memberName]?.value {
-                        case .rwproperty(_, let setter):
-                            return try setter(L)
-                        default:
-                            throw L.argumentError(2, "no set function defined for property \(memberName)")
-                        }
-                    }
+                        throw L.argumentError(2, "no set function defined for property \(memberName)")
+                    }, names: names)
                 }
                 unsynthesizedFields = nil
             } else {
@@ -521,9 +531,22 @@ extension Metatable.LeType where T: Comparable {
     }
 }
 
+extension UnsafeMutablePointer where Pointee == lua_State {
+    // For use by InternalMetafieldValue.fieldDispatch closures. Looks up the key at stack index 2 in the closure's
+    // slot table, returning the zero-based slot if found. Does not allocate.
+    fileprivate func fieldSlot() -> Int? {
+        lua_pushvalue(self, 2)
+        lua_rawget(self, LuaClosureWrapper.upvalueIndex(1))
+        let slot = lua_tointegerx(self, -1, nil)
+        pop()
+        return slot > 0 ? Int(slot) - 1 : nil
+    }
+}
+
 internal enum InternalUserdataField {
     case function(lua_CFunction)
     case closure(LuaClosure)
+    case wrapper(LuaClosureWrapper)
     case value(LuaValue)
     case property(LuaClosure)
     case rwproperty(LuaClosure, LuaClosure)
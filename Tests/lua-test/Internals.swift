@@ -20,3 +20,13 @@ extension LuaState {
         deprecated_registerMetatable(for: type, functions: functions)
     }
 }
+
+extension LuaState {
+    public func internal_residentMessageHandlerCount() -> Int {
+        return maybeGetState()?.residentMessageHandlers.count ?? 0
+    }
+
+    public func internal_liveLuaValueCount() -> Int {
+        return maybeGetState()?.luaValues.count ?? 0
+    }
+}
@@ -119,6 +119,84 @@ final class LuaTests: XCTestCase {
         XCTAssertEqual(try XCTUnwrap(expectedErr).description, "Deliberate error")
     }
 
+    func test_LuaFunctionHandle() throws {
+        try L.dostring("""
+            function add(a, b) return a + b end
+            function greet(name) return 'hello ' .. name end
+            function fail() error('nope', 0) end
+            callable = setmetatable({}, { __call = function(_, x) return x * 2 end })
+            """)
+
+        let add: LuaFunctionHandle<(Int, Int), Int> = try L.globals["add"].prepare(Int.self, Int.self)
+        for i in 1 ... 10 {
+            XCTAssertEqual(try add((i, 1)), i + 1)
+        }
+        XCTAssertEqual(L.gettop(), 0)
+
+        let greet: LuaFunctionHandle<String, String> = try L.globals["greet"].prepare(String.self)
+        XCTAssertEqual(try greet("world"), "hello world")
+
+        let fail: LuaFunctionHandle<Void, Void> = try L.globals["fail"].prepare(traceback: false)
+        XCTAssertThrowsError(try fail(), "", { err in
+            XCTAssertEqual(err as? LuaCallError, LuaCallError("nope"))
+        })
+        XCTAssertEqual(L.gettop(), 0)
+
+        let callable: LuaFunctionHandle<Double, LuaValue> = try L.globals["callable"].prepare(Double.self)
+        XCTAssertEqual(try callable(1.5)?.tonumber(), 3.0)
+
+        XCTAssertThrowsError(try L.ref(any: 123).prepare(returning: Void.self), "", { err in
+            XCTAssertEqual(err as? LuaValueError, .notCallable)
+        })
+        XCTAssertEqual(L.gettop(), 0)
+
+        // With a resident handler, errors still get a traceback and the handler stays put
+        L.pushResidentMessageHandler()
+        let failWithTraceback: LuaFunctionHandle<Void, Void> = try L.globals["fail"].prepare()
+        XCTAssertThrowsError(try failWithTraceback(), "", { err in
+            XCTAssertTrue((err as? LuaCallError)?.errorString.hasPrefix("nope\nstack traceback:\n") ?? false)
+        })
+        XCTAssertEqual(try add((1, 2)), 3)
+        XCTAssertEqual(L.gettop(), 1)
+        L.pop()
+    }
+
+    func test_pcall_batch() throws {
+        try L.dostring("""
+            function double(x)
+                if x < 0 then error("negative", 0) end
+                return x * 2
+            end
+            """)
+        let fn = L.globals["double"]
+
+        let results: LuaBatchResult<Int> = try fn.pcall(batch: [1, 2, 3])
+        XCTAssertEqual(results.results, [2, 4, 6])
+        XCTAssertEqual(results.errors, [:])
+        XCTAssertEqual(L.gettop(), 0)
+
+        let empty: LuaBatchResult<Int> = try fn.pcall(batch: [Int]())
+        XCTAssertEqual(empty.results, [])
+
+        XCTAssertThrowsError(try fn.pcall(batch: [1, -2, 3], traceback: false) as LuaBatchResult<Int>, "", { err in
+            XCTAssertEqual(err as? LuaCallError, LuaCallError("negative"))
+        })
+        XCTAssertEqual(L.gettop(), 0)
+
+        let skipped: LuaBatchResult<Int> = try fn.pcall(batch: [1, -2, 3], onError: .skip)
+        XCTAssertEqual(skipped.results, [2, nil, 6])
+        XCTAssertEqual(skipped.errors, [:])
+
+        let collected: LuaBatchResult<Int> = try fn.pcall(batch: [-1, 2, -3], onError: .collect, traceback: false)
+        XCTAssertEqual(collected.results, [nil, 4, nil])
+        XCTAssertEqual(collected.errors, [0: LuaCallError("negative"), 2: LuaCallError("negative")])
+        XCTAssertEqual(L.gettop(), 0)
+
+        XCTAssertThrowsError(try L.ref(any: 1).pcall(batch: [1]) as LuaBatchResult<Int>, "", { err in
+            XCTAssertEqual(err as? LuaValueError, .notCallable)
+        })
+    }
+
     func test_istype() {
         L.push(1234) // 1
         L.push(12.34) // 2
@@ -424,9 +502,14 @@ final class LuaTests: XCTestCase {
             }
         }
         XCTAssertThrowsError(try shouldError(), "", { err in
-            XCTAssertNotNil(err as? LuaCallError)
+            XCTAssertTrue((err as? LuaCallError)?.errorString.contains("I'm an erroring __index") ?? false)
         })
         XCTAssertEqual(last_i, 2)
+
+        // Check errors thrown by the block propagate, and leave the stack balanced
+        let top = L.gettop()
+        XCTAssertThrowsError(try L.for_ipairs(-1) { _ in throw LuaValueError.nilValue })
+        XCTAssertEqual(L.gettop(), top)
     }
 
     func test_for_pairs_raw() throws {
@@ -570,6 +653,60 @@ final class LuaTests: XCTestCase {
         XCTAssertTrue(dict.isEmpty) // All entries should have been removed by the pairs loop
     }
 
+    func test_LuaValue_borrowed_iteration() throws {
+        var dict: [String: String] = [:]
+        for i in 1 ... 100 {
+            dict["key\(i)"] = "value\(i)"
+        }
+        let dictValue = L.ref(any: dict)
+        let array = L.ref(any: (1 ... 100).map { "value\($0)" })
+        let liveValues = L.internal_liveLuaValueCount()
+
+        try dictValue.for_pairs(borrowed: { k, v in
+            let key = try XCTUnwrap(k.tostring())
+            XCTAssertEqual(v.tostring(), dict.removeValue(forKey: key))
+            XCTAssertEqual(L.internal_liveLuaValueCount(), liveValues)
+            return true
+        })
+        XCTAssertTrue(dict.isEmpty)
+
+        var last: lua_Integer = 0
+        try array.for_ipairs(borrowed: { i, val in
+            XCTAssertEqual(val.type, .string)
+            XCTAssertEqual(val.tostring(), "value\(i)")
+            XCTAssertEqual(L.internal_liveLuaValueCount(), liveValues)
+            last = i
+            return i < 50
+        })
+        XCTAssertEqual(last, 50)
+
+        // Neither loop should have created any LuaValues (and hence refs)
+        XCTAssertEqual(L.internal_liveLuaValueCount(), liveValues)
+        XCTAssertEqual(L.gettop(), 0)
+
+        // Check non-plain tables, and ref()
+        try L.load(string: """
+            local dict = ...
+            return setmetatable({}, { __pairs = function() return next, dict, nil end })
+            """)
+        L.push(["a": 1])
+        try L.pcall(nargs: 1, nret: 1)
+        let proxy = L.popref()
+        var refs: [LuaValue] = []
+        try proxy.for_pairs(borrowed: { k, v in
+            refs.append(k.ref())
+            refs.append(v.ref())
+            return true
+        })
+        XCTAssertEqual(refs.count, 2)
+        XCTAssertEqual(refs[0].tostring(), "a")
+        XCTAssertEqual(refs[1].toint(), 1)
+        XCTAssertEqual(L.gettop(), 0)
+
+        XCTAssertThrowsError(try array.for_ipairs(borrowed: { _, _ in throw LuaValueError.nilValue }))
+        XCTAssertEqual(L.gettop(), 0)
+    }
+
     func test_LuaValue_metatable() {
         XCTAssertNil(LuaValue().metatable)
 
@@ -650,6 +787,143 @@ final class LuaTests: XCTestCase {
         XCTAssertEqual(deinited, 1)
     }
 
+    func test_setDeferredFinalization() {
+        var deinited = 0
+        L.register(Metatable(for: DeinitChecker.self))
+        L.setDeferredFinalization(true)
+        for _ in 0 ..< 3 {
+            L.push(userdata: DeinitChecker { deinited += 1 })
+        }
+        L.settop(0)
+        L.collectgarbage()
+        XCTAssertEqual(deinited, 0)
+
+        XCTAssertEqual(L.releaseDeferredValues(limit: 2), 1)
+        XCTAssertEqual(deinited, 2)
+        XCTAssertEqual(L.takeDeferredValues().count, 1)
+        XCTAssertEqual(deinited, 3)
+        XCTAssertEqual(L.releaseDeferredValues(), 0)
+
+        // Releasing in small batches, with more values being queued in between
+        for _ in 0 ..< 5 {
+            L.push(userdata: DeinitChecker { deinited += 1 })
+        }
+        L.settop(0)
+        L.collectgarbage()
+        XCTAssertEqual(L.releaseDeferredValues(limit: 1), 4)
+        XCTAssertEqual(L.releaseDeferredValues(limit: 1), 3)
+        XCTAssertEqual(deinited, 5)
+        L.push(userdata: DeinitChecker { deinited += 1 })
+        L.pop()
+        L.collectgarbage()
+        XCTAssertEqual(L.releaseDeferredValues(limit: 2), 2)
+        XCTAssertEqual(deinited, 7)
+        XCTAssertEqual(L.takeDeferredValues().count, 2)
+        XCTAssertEqual(deinited, 9)
+
+        L.setDeferredFinalization(false)
+        L.push(userdata: DeinitChecker { deinited += 1 })
+        L.pop()
+        L.collectgarbage()
+        XCTAssertEqual(deinited, 10)
+    }
+
+    func test_LuaMemoryReporting() {
+        class BigThing: LuaMemoryReporting {
+            var luaExternalMemorySize: Int { 100 * 1024 * 1024 }
+        }
+        var deinited = 0
+        L.register(Metatable(for: DeinitChecker.self))
+        L.register(Metatable(for: BigThing.self))
+        L.collectgarbage()
+        L.push(userdata: DeinitChecker { deinited += 1 })
+        L.pop()
+
+        L.collectgarbage(.stop)
+        L.push(userdata: BigThing())
+        L.pop()
+        XCTAssertEqual(deinited, 0)
+
+        // Pushing a BigThing when the collector is running should be enough to complete a collection cycle
+        L.collectgarbage(.restart)
+        L.push(userdata: BigThing())
+        XCTAssertEqual(deinited, 1)
+    }
+
+    func test_openVectorLibrary() throws {
+        L.openVectorLibrary()
+        try L.dostring("""
+            a = vector.new(1, 2, 3)
+            b = vector.new(4, 5, 6)
+            c = (a + b) * 2
+            """)
+        L.getglobal("c")
+        XCTAssertEqual(L.tovector(-1), SIMD3<Double>(10, 14, 18))
+        XCTAssertNil(L.tovector(-1) as SIMD4<Double>?)
+        // Vectors are plain data so don't need finalizing
+        XCTAssertTrue(lua_getmetatable(L, -1) != 0)
+        XCTAssertEqual(L.rawget(-1, utf8Key: "__gc"), .nil)
+        L.pop(2)
+
+        // Opening the library again is harmless
+        L.openVectorLibrary()
+        XCTAssertEqual(L.tovector(-1), SIMD3<Double>(10, 14, 18))
+        L.pop()
+
+        L.push(vector: SIMD2<Double>(3, 4))
+        L.setglobal(name: "d")
+        try L.dostring("""
+            assert(d.x == 3 and d[2] == 4 and #d == 2 and d.z == nil)
+            assert(d:length() == 5 and vector.length(d) == 5)
+            assert(a:dot(b) == 32)
+            assert(a:cross(b) == vector.new(-3, 6, -3))
+            assert(-a == vector.new(-1, -2, -3) and b / 2 == vector.new(2, 2.5, 3))
+            assert(a ~= b and a ~= d)
+            assert(tostring(d) == "vector(3, 4)" or tostring(d) == "vector(3.0, 4.0)")
+            """)
+        XCTAssertThrowsError(try L.dostring("return a + d"))
+        XCTAssertThrowsError(try L.dostring("return a + 1"))
+
+        try L.dostring("""
+            m = vector.matrix(1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  10, 20, 30, 1)
+            assert(vector.identity() * m == m and m[13] == 10)
+            return m * vector.new(1, 2, 3, 1), m:transpose()
+            """)
+        XCTAssertEqual(L.tovector(1), SIMD4<Double>(11, 22, 33, 1))
+        let transposed = try XCTUnwrap(L.tomatrix(2))
+        XCTAssertEqual(transposed[3], 10)
+        XCTAssertEqual(transposed[12], 0)
+    }
+
+    func test_pushuserdata_threads() {
+        struct Foo : Equatable {
+            let intval: Int
+        }
+        // Created before anything has needed to set up the internal LuaSwift state
+        let early: LuaState = lua_newthread(L)
+        L.register(Metatable(for: Foo.self))
+        let late: LuaState = lua_newthread(L)
+        L.push(userdata: Foo(intval: 1))
+
+        for thread in [early, late] {
+            L.push(index: -1)
+            lua_xmove(L, thread, 1)
+            let val: Foo? = thread.touserdata(-1)
+            XCTAssertEqual(val, Foo(intval: 1))
+
+            thread.push(userdata: Foo(intval: 2))
+            let newVal: Foo? = thread.touserdata(-1)
+            XCTAssertEqual(newVal, Foo(intval: 2))
+
+            XCTAssertEqual(thread.getMainThread(), L)
+            let ref = L.ref(any: "hello")
+            thread.push(ref)
+            XCTAssertEqual(thread.tostring(-1), "hello")
+            thread.settop(0)
+        }
+        L.settop(0)
+    }
+
     func test_pushuserdata_close() throws {
         try XCTSkipIf(!LUA_VERSION.is54orLater())
 
@@ -821,6 +1095,14 @@ final class LuaTests: XCTestCase {
         try L.pcall(nargs: 2, nret: 1)
         XCTAssertEqual(L.tostring(-1), "!")
         L.pop()
+
+        // Unknown fields are nil, non-string keys and setting readonly or unknown properties are errors
+        XCTAssertEqual(try L.get(1, key: "nope"), .nil)
+        L.pop()
+        XCTAssertThrowsError(try L.get(1, key: 1))
+        XCTAssertThrowsError(try L.set(1, key: "data", value: "x"))
+        XCTAssertThrowsError(try L.set(1, key: "nope", value: "x"))
+        XCTAssertEqual(val.member, "anewval")
     }
 
     func test_legacy_registerDefaultMetatable() throws {
@@ -848,6 +1130,73 @@ final class LuaTests: XCTestCase {
         XCTAssertEqual(called, true)
     }
 
+    func test_MetatableBlueprint() throws {
+        class Foo {
+            var prop = 1
+            func double() -> Int { return prop * 2 }
+        }
+        struct Bar {}
+        var blueprint = MetatableBlueprint()
+        blueprint.add(Metatable(for: Foo.self, fields: [
+            "prop": .property(get: { $0.prop }, set: { $0.prop = $1 }),
+            "double": .memberfn { $0.double() },
+        ]))
+        blueprint.add(Metatable(for: Bar.self, call: .closure { L in
+            L.push(42)
+            return 1
+        }))
+
+        L.register(blueprint, lazily: true)
+        XCTAssertTrue(L.isMetatableRegistered(for: Foo.self))
+        try L.load(string: "local foo = ...; foo.prop = 3; return foo:double()")
+        L.push(userdata: Foo())
+        try L.pcall(nargs: 1, nret: 1)
+        XCTAssertEqual(L.toint(-1), 6)
+        L.pop()
+
+        // The same blueprint can be used eagerly with another state
+        let L2 = LuaState(libraries: [])
+        defer {
+            L2.close()
+        }
+        L2.register(blueprint)
+        XCTAssertTrue(L2.isMetatableRegistered(for: Bar.self))
+        L2.push(userdata: Bar())
+        try L2.pcall(nargs: 0, nret: 1)
+        XCTAssertEqual(L2.toint(-1), 42)
+    }
+
+    func test_enableIdentityMap() throws {
+        class Foo {}
+        class Bar {}
+        L.register(Metatable(for: Foo.self))
+        L.register(Metatable(for: Bar.self))
+        L.enableIdentityMap(for: Foo.self)
+
+        let foo = Foo()
+        L.push(userdata: foo)
+        L.push(userdata: foo)
+        XCTAssertTrue(L.rawequal(-1, -2))
+        XCTAssertTrue(L.touserdata(-1) as Foo? === foo)
+        L.push(userdata: Foo())
+        XCTAssertFalse(L.rawequal(-1, -2))
+        L.settop(0)
+
+        // Not enabled for Bar
+        let bar = Bar()
+        L.push(userdata: bar)
+        L.push(userdata: bar)
+        XCTAssertFalse(L.rawequal(-1, -2))
+        L.settop(0)
+
+        // Once collected, pushing foo again creates a new userdata
+        L.push(userdata: foo)
+        L.pop()
+        L.collectgarbage()
+        L.push(userdata: foo)
+        XCTAssertTrue(L.touserdata(-1) as Foo? === foo)
+    }
+
     func test_registerDefaultMetatable() throws {
         struct Foo {}
         L.register(DefaultMetatable(
@@ -861,6 +1210,17 @@ final class LuaTests: XCTestCase {
         L.push(userdata: Foo())
         try L.pcall(nargs: 1, nret: 1)
         XCTAssertEqual(L.tovalue(1), 321)
+        L.settop(0)
+
+        // Registering a type which previously used the default metatable means subsequent pushes must use the new one
+        L.register(Metatable(for: Foo.self, call: .closure { L in
+            L.push(123)
+            return 1
+        }))
+        try! L.load(string: "obj = ...; return obj()")
+        L.push(userdata: Foo())
+        try L.pcall(nargs: 1, nret: 1)
+        XCTAssertEqual(L.tovalue(1), 123)
     }
 
     func test_equatableMetamethod() throws {
@@ -1356,6 +1716,14 @@ final class LuaTests: XCTestCase {
         lua_setmetatable(L, -2)
         let stillbad: Any? = L.touserdata(-1)
         XCTAssertNil(stillbad)
+
+        // Nor should giving it a LuaSwift metatable make any difference (and its __gc must not touch the memory)
+        L.pushMetatable(for: DeinitChecker.self)
+        lua_setmetatable(L, -2)
+        let alsobad: DeinitChecker? = L.touserdata(-1)
+        XCTAssertNil(alsobad)
+        L.pop()
+        L.collectgarbage()
     }
 
     func test_ref() {
@@ -1401,6 +1769,54 @@ final class LuaTests: XCTestCase {
         L = nil // make sure teardown doesn't try to close it again
     }
 
+    func test_ref_reuse_scoping() {
+        // Check refs being released and reused are still all tracked correctly when the state is closed
+        var refs: [LuaValue] = (0 ..< 10).map { L.ref(any: $0) }
+        refs.removeSubrange(2 ..< 8)
+        refs.append(contentsOf: (10 ..< 20).map { L.ref(any: $0) })
+        XCTAssertEqual(refs.map { $0.toint() }, [0, 1, 8, 9] + Array(10 ..< 20))
+        L.close()
+        for ref in refs {
+            XCTAssertNil(ref.internal_get_L())
+        }
+        refs = []
+
+        L = nil // make sure teardown doesn't try to close it again
+    }
+
+    func test_ref_scalars() throws {
+        // Scalars are stored inline, so compare by value
+        XCTAssertEqual(L.ref(any: 123), L.ref(any: 123))
+        XCTAssertEqual(L.ref(any: 1.5), L.ref(any: 1.5))
+        XCTAssertEqual(L.ref(any: true), L.ref(any: true))
+        XCTAssertNotEqual(L.ref(any: 1), L.ref(any: 1.0))
+        XCTAssertNotEqual(L.ref(any: [1]), L.ref(any: [1]))
+        XCTAssertEqual(Set([L.ref(any: 1), L.ref(any: 1), L.ref(any: 2)]).count, 2)
+        // Equatable must be reflexive, even for NaN
+        let nan = L.ref(any: Double.nan)
+        XCTAssertEqual(nan, nan)
+        XCTAssertEqual(L.ref(any: Double.nan), L.ref(any: Double.nan))
+        XCTAssertEqual(Set([nan, nan]).count, 1)
+
+        let int = L.ref(any: 42)
+        let num = L.ref(any: 0.25)
+        let bool = L.ref(any: false)
+        XCTAssertEqual(int.type, .number)
+        XCTAssertEqual(bool.type, .boolean)
+        XCTAssertEqual(int.toint(), 42)
+        XCTAssertEqual(num.tonumber(), 0.25)
+        XCTAssertEqual(bool.toboolean(), false)
+        XCTAssertEqual(L.gettop(), 0)
+
+        try L.dostring("function double(x) return x * 2 end")
+        XCTAssertEqual(try L.globals["double"].pcall(int).toint(), 84)
+
+        L.close()
+        XCTAssertNil(int.internal_get_L())
+        XCTAssertNil(bool.internal_get_L())
+        L = nil // make sure teardown doesn't try to close it again
+    }
+
     func test_ref_get() throws {
         let strType = try L.globals["type"].pcall("foo").tostring()
         XCTAssertEqual(strType, "string")
@@ -1436,6 +1852,36 @@ final class LuaTests: XCTestCase {
         XCTAssertEqual(try udref.get("woop").tostring(), "woop")
     }
 
+    func test_LuaPath() throws {
+        try L.dostring("""
+            config = { limits = { rps = 100, list = { 11, 22 } } }
+            proxied = setmetatable({}, { __index = function(_, k) return { answer = k } end })
+            """)
+        XCTAssertEqual(try L.globals.get(LuaPath("config", "limits", "rps")).toint(), 100)
+        XCTAssertEqual(try L.globals.get(LuaPath("config", "limits", "list", 2), as: Int.self), 22)
+        XCTAssertEqual(L.globals[LuaPath("config", "limits", "rps")].toint(), 100)
+        XCTAssertEqual(L.globals[LuaPath("config", "limits")].type, .table)
+        XCTAssertEqual(try L.globals.get(LuaPath("proxied", "foo", "answer"), as: String.self), "foo")
+        XCTAssertNil(try L.globals.get(LuaPath("config", "nope"), as: Int.self))
+        let name = "list"
+        let index = 1
+        let path = LuaPath(keys: ["config", "limits", LuaPath.Key(name), LuaPath.Key(index)])
+        XCTAssertEqual(try L.globals.get(path, as: Int.self), 11)
+        XCTAssertEqual(L.gettop(), 0)
+
+        XCTAssertThrowsError(try L.globals.get(LuaPath("config", "nope", "rps")), "", { err in
+            XCTAssertEqual(err as? LuaValueError, .nilValue)
+        })
+        XCTAssertThrowsError(try L.globals.get(LuaPath("proxied", "foo", "answer", "x")), "", { err in
+            XCTAssertEqual(err as? LuaValueError, .notIndexable)
+        })
+        XCTAssertThrowsError(try L.globals.get(LuaPath("config", "limits", "rps", "x")), "", { err in
+            XCTAssertEqual(err as? LuaValueError, .notIndexable)
+        })
+        XCTAssertEqual(L.globals[LuaPath("config", "nope", "rps")].type, .nil)
+        XCTAssertEqual(L.gettop(), 0)
+    }
+
     func test_ref_chaining() throws {
         L.openLibraries([.string])
         let result = try L.globals.get("type").pcall(L.globals["print"]).pcall(member: "sub", 1, 4).tostring()
@@ -1835,6 +2281,29 @@ final class LuaTests: XCTestCase {
 
 // #endif
 
+//     func test_pcall_perf() {
+//         L.push(function: dummyFn)
+//         let fn = L.popref()
+//         measure {
+//             for _ in 0 ..< 100000 {
+//                 L.push(fn)
+//                 try! L.pcall(nargs: 0, nret: 0)
+//             }
+//         }
+//     }
+
+//     func test_pcall_perf_resident_msgh() {
+//         L.pushResidentMessageHandler()
+//         L.push(function: dummyFn)
+//         let fn = L.popref()
+//         measure {
+//             for _ in 0 ..< 100000 {
+//                 L.push(fn)
+//                 try! L.pcall(nargs: 0, nret: 0)
+//             }
+//         }
+//     }
+
     func test_load_file() {
         XCTAssertThrowsError(try L.load(file: "nopemcnopeface"), "", { err in
             XCTAssertEqual(err as? LuaLoadError, .fileError("cannot open nopemcnopeface: No such file or directory"))
@@ -2023,6 +2492,94 @@ final class LuaTests: XCTestCase {
         XCTAssertEqual(L.todecodable(7, type: Foo.self), Foo(bar: "sheep", baz: 321, bat: [true, false]))
     }
 
+    func test_todecodable_keyed() throws {
+        struct Point: Equatable, Decodable {
+            let x: Int
+            let y: Int
+            let name: String?
+        }
+        // Element 2 has a metatable so must take the non-raw path, and element 3 errors on lookup
+        try L.dostring("""
+            return {
+                { x = 1, y = 2, name = "one" },
+                setmetatable({ x = 3 }, { __index = { y = 4 } }),
+                setmetatable({}, { __index = function() error("NOPE") end }),
+            }
+            """)
+        XCTAssertEqual(L.todecodable(1, type: [Point].self), nil)
+        L.rawset(1, key: 3, value: .nilValue)
+        XCTAssertEqual(L.todecodable(1, type: [Point].self), [Point(x: 1, y: 2, name: "one"), Point(x: 3, y: 4, name: nil)])
+        // Decoding the same type a second time reuses the cached key strings
+        XCTAssertEqual(L.todecodable(1, type: [Point].self)?.count, 2)
+        XCTAssertEqual(L.gettop(), 1)
+
+        // Dictionary keys are unbounded, check decoding more than KeyPlan caches still works
+        var dict: [String: Int] = [:]
+        for i in 1 ... 300 {
+            dict["key\(i)"] = i
+        }
+        L.push(dict)
+        XCTAssertEqual(L.todecodable(-1, type: [String: Int].self), dict)
+        XCTAssertEqual(L.todecodable(-1, type: [String: Int].self), dict)
+        L.pop()
+        XCTAssertEqual(L.gettop(), 1)
+    }
+
+    func test_tocolumns() throws {
+        try L.dostring("""
+            return {
+                { ts = 1, v = 1.5, name = "one" },
+                { ts = 2, v = 2, name = "two", extra = true },
+                { ts = 3.0, v = -1, name = "three" },
+            }
+            """)
+        let columns = try XCTUnwrap(L.tocolumns(1, schema: ["ts": .integer, "v": .number, "name": .string]))
+        XCTAssertEqual(columns.count, 3)
+        XCTAssertEqual(columns.integers["ts"], [1, 2, 3])
+        XCTAssertEqual(columns.numbers["v"], [1.5, 2.0, -1.0])
+        XCTAssertEqual(columns.strings["name"], ["one", "two", "three"])
+        XCTAssertEqual(L.gettop(), 1)
+
+        XCTAssertNil(L.tocolumns(1, schema: ["v": .integer])) // 1.5 is not an integer
+        XCTAssertNil(L.tocolumns(1, schema: ["extra": .string])) // not present in every record
+        XCTAssertNil(L.tocolumns(1, schema: ["ts": .string]))
+        XCTAssertEqual(L.tocolumns(1, schema: [:])?.count, 3)
+        XCTAssertEqual(L.gettop(), 1)
+
+        L.newtable()
+        XCTAssertEqual(L.tocolumns(2, schema: ["ts": .integer])?.integers["ts"], [])
+    }
+
+    func test_toplainvalue() throws {
+        try L.dostring("""
+            local cycle = {}
+            cycle.self = cycle
+            return { 1, 2.5, "three", true }, { a = { b = "c" }, [10] = false }, "\\xFF\\xFE", {}, cycle, function() end
+            """)
+        let array = LuaPlainValue.array([.int(1), .double(2.5), .string("three"), .bool(true)])
+        let map = LuaPlainValue.map([.string("a"): .map([.string("b"): .string("c")]), .int(10): .bool(false)])
+        XCTAssertEqual(L.toplainvalue(1), array)
+        XCTAssertEqual(L.toplainvalue(2), map)
+        XCTAssertEqual(L.toplainvalue(3), .bytes([0xFF, 0xFE]))
+        XCTAssertEqual(L.toplainvalue(4), .array([]))
+        XCTAssertNil(L.toplainvalue(5))
+        XCTAssertNil(L.toplainvalue(6))
+        XCTAssertEqual(L.toplainvalue(7), .nil) // none
+        XCTAssertEqual(L.gettop(), 6)
+
+        L.settop(0)
+        L.push(map)
+        L.push(array)
+        XCTAssertEqual(L.toplainvalue(1), map)
+        XCTAssertEqual(L.toplainvalue(2), array)
+        XCTAssertEqual(L.ref(index: 2).toplainvalue(), array)
+
+#if !LUASWIFT_NO_FOUNDATION
+        let json = try JSONEncoder().encode(LuaPlainValue.map([.string("x"): array]))
+        XCTAssertEqual(try JSONDecoder().decode(LuaPlainValue.self, from: json), .map([.string("x"): array]))
+#endif
+    }
+
     func test_get_set() throws {
         L.push([11, 22, 33, 44, 55])
         // Do all accesses here with negative indexes to make sure they are handled right.
@@ -2082,6 +2639,23 @@ final class LuaTests: XCTestCase {
         try L.set(-1, key: 3, value: 333)
         XCTAssertEqual(L.rawget(-1, key: 3, { L.toint($0) } ), 333)
         XCTAssertEqual(L.gettop(), 1)
+
+        // Invalid keys must still error (rather than panic) on a table without a metatable
+        XCTAssertThrowsError(try L.set(-1, key: .nilValue, value: 1))
+        XCTAssertThrowsError(try L.set(-1, key: Double.nan, value: 1))
+        XCTAssertEqual(L.gettop(), 1)
+        XCTAssertEqual(try L.get(-1, key: .nilValue), .nil)
+        L.pop()
+
+        // And metamethods must still be honoured
+        try L.dostring("return setmetatable({}, { __index = function(_, k) return k * 2 end, __newindex = function() error('nope', 0) end })")
+        try L.get(-1, key: 4)
+        XCTAssertEqual(L.toint(-1), 8)
+        L.pop()
+        XCTAssertThrowsError(try L.set(-1, key: 1, value: 1), "", { err in
+            XCTAssertEqual(err as? LuaCallError, LuaCallError("nope"))
+        })
+        XCTAssertEqual(L.gettop(), 1)
     }
 
     func test_getinfo() throws {
@@ -2283,6 +2857,26 @@ final class LuaTests: XCTestCase {
         XCTAssertFalse(try one.equal(two))
         XCTAssertTrue(try one.compare(two, .lt)) // ie one < two
         XCTAssertFalse(try two.compare(one, .lt)) // ie two < one
+
+        L.settop(0)
+        L.push("abc")
+        L.push("abd")
+        L.push(1.5)
+        XCTAssertTrue(try L.compare(1, 2, .lt))
+        XCTAssertFalse(try L.compare(2, 1, .le))
+        XCTAssertFalse(try L.equal(1, 3))
+        XCTAssertTrue(try L.compare(3, 3, .le))
+        XCTAssertThrowsError(try L.compare(1, 3, .lt)) // Cannot compare string with number
+
+        try L.dostring("""
+            local mt = { __eq = function() return true end, __lt = function() error('nope', 0) end }
+            return setmetatable({}, mt), setmetatable({}, mt)
+            """)
+        XCTAssertTrue(try L.equal(-1, -2))
+        XCTAssertThrowsError(try L.compare(-1, -2, .lt), "", { err in
+            XCTAssertEqual(err as? LuaCallError, LuaCallError("nope"))
+        })
+        XCTAssertEqual(L.gettop(), 5)
     }
 
     func test_gc() {
@@ -2454,6 +3048,121 @@ final class LuaTests: XCTestCase {
         }
     }
 
+    func test_pcall_lazyTraceback() throws {
+        try L.load(string: """
+            local function inner() error("Deliberate error") end
+            local function outer() inner() end
+            outer()
+            """, name: "=chunk")
+        let fn = L.ref(index: -1)
+        L.pop()
+
+        L.setLazyTraceback(true)
+        var lazyErr: LuaCallError? = nil
+        do {
+            try fn.pcall()
+        } catch let error as LuaCallError {
+            lazyErr = error
+        }
+        XCTAssertEqual(L.gettop(), 0)
+
+        L.setLazyTraceback(false)
+        var eagerErr: LuaCallError? = nil
+        do {
+            try fn.pcall()
+        } catch let error as LuaCallError {
+            eagerErr = error
+        }
+
+        // Make sure the traceback can still be formatted after the state has gone
+        L.close()
+        L = nil
+
+        let lazyLines = try XCTUnwrap(lazyErr).description.split(separator: "\n")
+        let eagerLines = try XCTUnwrap(eagerErr).description.split(separator: "\n")
+        XCTAssertEqual(lazyLines.first, "chunk:1: Deliberate error")
+        XCTAssertEqual(lazyLines.last, "\tchunk:3: in main chunk")
+        XCTAssertTrue(lazyLines.contains("\t[C]: in global 'error'"))
+        XCTAssertEqual(lazyLines.count, eagerLines.count)
+        for (lazyLine, eagerLine) in zip(lazyLines, eagerLines) {
+            // Only the eager traceback looks up global function names
+            if !eagerLine.contains("in function '") {
+                XCTAssertEqual(lazyLine, eagerLine)
+            }
+        }
+    }
+
+    func test_pcall_lazyTraceback_unclaimed() throws {
+        L.setLazyTraceback(true)
+        L.pushResidentMessageHandler()
+        // Nothing would claim a lazy traceback from a raw lua_pcall using the resident handler, so it gets a normal one
+        try L.load(string: "error('raw')", name: "=raw")
+        XCTAssertNotEqual(lua_pcall(L, 0, 0, 1), LUA_OK)
+        XCTAssertTrue(L.tostring(-1)?.hasPrefix("raw:1: raw\nstack traceback:\n") ?? false)
+        L.pop()
+
+        // And no lazy traceback ends up attached to an unrelated error
+        try L.load(string: "error('plain')", name: "=plain")
+        XCTAssertThrowsError(try L.pcall(traceback: false)) { err in
+            XCTAssertEqual((err as? LuaCallError)?.errorString, "plain:1: plain")
+        }
+        try L.load(string: "error('traced')", name: "=traced")
+        XCTAssertThrowsError(try L.pcall()) { err in
+            let str = (err as? LuaCallError)?.errorString ?? ""
+            XCTAssertTrue(str.hasPrefix("traced:1: traced\nstack traceback:\n"))
+            XCTAssertTrue(str.contains("traced:1: in main chunk"))
+            XCTAssertFalse(str.contains("raw"))
+        }
+        XCTAssertEqual(L.gettop(), 1)
+    }
+
+    func test_pushResidentMessageHandler() throws {
+        L.pushResidentMessageHandler()
+        XCTAssertEqual(L.gettop(), 1)
+
+        try L.load(string: "error 'Nope'")
+        XCTAssertThrowsError(try L.pcall()) { err in
+            XCTAssertTrue((err as? LuaCallError)?.errorString.hasPrefix("[string \"error 'Nope'\"]:1: Nope\nstack traceback:\n") ?? false)
+        }
+        // The handler should still be in place
+        XCTAssertEqual(L.gettop(), 1)
+
+        L.getglobal("type")
+        L.push(123)
+        try L.pcall(nargs: 1, nret: 1)
+        XCTAssertEqual(L.tostring(-1), "number")
+        L.pop()
+        XCTAssertEqual(L.gettop(), 1)
+
+        // Once popped, the normal insert/remove behaviour is used
+        XCTAssertEqual(L.internal_residentMessageHandlerCount(), 1)
+        L.pop()
+        try L.load(string: "error 'Nope'")
+        XCTAssertThrowsError(try L.pcall())
+        XCTAssertEqual(L.gettop(), 0)
+
+        // And the entry goes away once the handler is collected
+        L.collectgarbage()
+        XCTAssertEqual(L.internal_residentMessageHandlerCount(), 0)
+    }
+
+    func test_pushResidentMessageHandler_coroutine() throws {
+        let co = try XCTUnwrap(lua_newthread(L))
+        co.pushResidentMessageHandler()
+        XCTAssertEqual(L.internal_residentMessageHandlerCount(), 1)
+
+        try co.load(string: "error 'Nope'")
+        XCTAssertThrowsError(try co.pcall()) { err in
+            XCTAssertTrue((err as? LuaCallError)?.errorString.hasPrefix("[string \"error 'Nope'\"]:1: Nope\nstack traceback:\n") ?? false)
+        }
+        XCTAssertEqual(co.gettop(), 1)
+
+        // The entry goes away along with the thread
+        L.pop()
+        L.collectgarbage()
+        XCTAssertEqual(L.internal_residentMessageHandlerCount(), 0)
+    }
+
     func test_traceback_tableerr() {
         try! L.load(string: "error({ err = 'doom' })")
         XCTAssertThrowsError(try L.pcall()) { err in
@@ -2586,6 +3295,29 @@ final class LuaTests: XCTestCase {
         XCTAssertThrowsError(try pcallNoPop("str", nil))
         XCTAssertThrowsError(try pcallNoPop(123, "str"))
         L.pop()
+
+        // Check the scalar fast paths in checkArgument agree with tovalue
+        L.push({ L in
+            let i: Int = try L.checkArgument(1)
+            let d: Double = try L.checkArgument(2)
+            let b: Bool = try L.checkArgument(3)
+            let s: String = try L.checkArgument(4)
+            XCTAssertEqual(i, L.tovalue(1))
+            XCTAssertEqual(d, L.tovalue(2))
+            XCTAssertEqual(b, L.tovalue(3))
+            XCTAssertEqual(s, L.tovalue(4))
+            return 0
+        })
+        try pcallNoPop(123, 456, true, "str")
+        try pcallNoPop(123.0, 1.5, false, "")
+        XCTAssertThrowsError(try pcallNoPop(1.5, 1, true, "str"), "", { err in
+            let errorString = (err as? LuaCallError)?.errorString ?? ""
+            XCTAssertTrue(errorString.hasPrefix("bad argument #1 to '?' (Expected type convertible to Int, got number)"))
+        })
+        XCTAssertThrowsError(try pcallNoPop(1, "1", true, "str"))
+        XCTAssertThrowsError(try pcallNoPop(1, 1, 1, "str"))
+        XCTAssertThrowsError(try pcallNoPop(1, 1, true, 1))
+        L.pop()
     }
 
     func test_luaTableToArray() {